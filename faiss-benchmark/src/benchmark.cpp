@@ -153,26 +153,14 @@ void Benchmark(const faiss::Index* index, size_t count, size_t top_n,
 }
 
 template <typename T>
-std::shared_ptr<float> PrepareQueries(util::vecs::File* file, size_t dim,
-        size_t& count) {
-    util::vecs::Formater<T> reader(file);
-    count = 0;
-    while (reader.skip()) {
-        count++;
-    }
-    reader.reset();
-    float* cursor = new float[count * dim];
-    std::shared_ptr<float> queries(cursor);
-    util::vector::Converter<T, float> converter;
-    for (size_t i = 0; i < count; i++) {
-        std::vector<T> vector = reader.read();
-        if (vector.size() != dim) {
-            char buf[256];
-            sprintf(buf, "query vector is not %luD!", dim);
-            throw std::runtime_error(buf);
-        }
-        converter(cursor, vector);
-        cursor += dim;
+std::shared_ptr<float> PrepareQueries(util::vecs::File* file,
+        const util::vecs::Catalog& catalog, size_t dim, size_t& count) {
+    util::vecs::Formater<T> reader(file, &catalog);
+    count = reader.count();
+    std::shared_ptr<float> queries(new float[count * dim],
+            std::default_delete<float[]>());
+    if (reader.readBatchConverted(count, dim, queries.get()) != count) {
+        throw std::runtime_error("broken file of query vectors!");
     }
     return queries;
 }
@@ -181,20 +169,22 @@ std::shared_ptr<float> PrepareQueries(const char* fpath, size_t dim,
         size_t& count) {
     util::vecs::SuffixWrapper query(fpath, true);
     typedef std::shared_ptr<float> (*func_t)(util::vecs::File*,
-            size_t, size_t&);
+            const util::vecs::Catalog&, size_t, size_t&);
     static const struct Entry {
         char type;
         func_t func;
     }
     entries[] = {
         {'b', PrepareQueries<uint8_t>},
+        {'c', PrepareQueries<int8_t>},
         {'i', PrepareQueries<int32_t>},
         {'f', PrepareQueries<float>},
     };
     for (size_t i = 0; i < sizeof(entries) / sizeof(Entry); i++) {
         const Entry* entry = entries + i;
         if (query.getDataType() == entry->type) {
-            return entry->func(query.getFile(), dim, count);
+            return entry->func(query.getFile(), query.getCatalog(), dim,
+                    count);
         }
     }
     throw std::runtime_error("unsupported format of query vectors!");
@@ -208,15 +198,15 @@ std::shared_ptr<faiss::Index::idx_t> PrepareGroundTruths(size_t count,
     util::vecs::Formater<T> reader(gt_file);
     util::vector::Converter<T, faiss::Index::idx_t> converter;
     for (size_t i = 0; i < count; i++) {
-        std::vector<T> gt = reader.read();
-        if (gt.size() < top_n) {
+        size_t gt_dim;
+        const T* gt = reader.view(gt_dim);
+        if (gt_dim < top_n) {
             char buf[256];
             sprintf(buf, "groundtruth vector is less than %luD!", top_n);
             throw std::runtime_error(buf);
         }
-        gt.resize(top_n);
-        std::sort(gt.begin(), gt.end());
-        converter(cursor, gt);
+        converter(cursor, gt, top_n);
+        std::sort(cursor, cursor + top_n);
         cursor += top_n;
     }
     return gts;
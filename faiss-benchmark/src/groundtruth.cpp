@@ -1,169 +1,1296 @@
-#include <list>
+#include <cmath>
+#include <deque>
 #include <mutex>
-#include <queue>
+#include <atomic>
+#include <limits>
 #include <thread>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#include <sys/stat.h>
 
 #include "util/vecs.h"
+#include "util/numa.h"
+#include "util/string.h"
 #include "util/vector.h"
 
-template <typename TBase, typename TQuery, typename TDistance,
-        typename TIndex>
-std::vector<TIndex> Generate(
-        const std::list<std::vector<TBase>>& base_vectors,
-        const std::vector<TQuery>& query_vector,
-        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n) {
-    size_t count = base_vectors.size();
-    if (top_n > count) {
-        char buf[256];
-        sprintf(buf, "argument <top_n = %lu> is larger than vector count!",
-                count);
-        throw std::runtime_error(buf);
+// Both engines compare tiles of QUERY_TILE queries with tiles of base
+// vectors of about BASE_TILE bytes, which stay in L2 while each base vector
+// loaded from memory is used by all the queries of the tile.
+#define QUERY_TILE          64
+#define BASE_TILE           (256UL << 10)
+#define GEMM_LOAD_BATCH     4096
+#define TOPN_SLACK          64
+
+// With a checkpoint, the base is loaded in shards of this size by default,
+// and the partial results are saved after each shard.
+#define CHECKPOINT_SHARD    (1UL << 30)
+#define CHECKPOINT_MAGIC    "VECSGTC1"
+
+struct Options {
+    std::string engine;
+    size_t shard_size;
+    std::string checkpoint;
+    std::string dist;
+    double radius;
+    bool numa;
+
+    Options() : engine("exact"), shard_size(0), radius(HUGE_VAL),
+            numa(true) {}
+
+    // <joint> is a comma-split string like "engine=gemm,shard=64G".
+    void parse(const char* joint) {
+        auto func = [this](const char* str, size_t len) -> int {
+            std::string option(str, len);
+            if (option.empty()) {
+                return 0;
+            }
+            size_t pos = option.find('=');
+            if (pos == std::string::npos) {
+                throw std::runtime_error(std::string("invalid option: '")
+                        .append(option).append("'!"));
+            }
+            std::string key = option.substr(0, pos);
+            std::string value = option.substr(pos + 1);
+            if (key == "engine" && (value == "exact" || value == "gemm")) {
+                engine = value;
+            }
+            else if (key == "shard" && ParseSize(value, &shard_size)) {}
+            else if (key == "checkpoint" && !value.empty()) {
+                checkpoint = value;
+            }
+            else if (key == "dist" && !value.empty()) {
+                dist = value;
+            }
+            else if (key == "radius" && ParseDistance(value, &radius)) {}
+            else if (key == "numa" && (value == "on" || value == "off")) {
+                numa = value == "on";
+            }
+            else {
+                throw std::runtime_error(std::string("unsupported option: '")
+                        .append(option).append("'!"));
+            }
+            return 0;
+        };
+        util::string::split(joint, ",", &func);
+    }
+
+private:
+    // Like "1024", "512M" or "64G".
+    static bool ParseSize(const std::string& str, size_t* size) {
+        char unit = 0;
+        char tail;
+        int n = sscanf(str.c_str(), "%lu%c%c", size, &unit, &tail);
+        if (n == 1) {
+            return true;
+        }
+        const char* units = "KMGT";
+        const char* pos = strchr(units, unit);
+        if (n != 2 || unit == 0 || !pos) {
+            return false;
+        }
+        *size <<= 10 * (pos - units + 1);
+        return true;
+    }
+
+    static bool ParseDistance(const std::string& str, double* distance) {
+        char tail;
+        return sscanf(str.c_str(), "%lf%c", distance, &tail) == 1 &&
+                !std::isnan(*distance);
     }
+
+};
+
+// The <top_n> nearest, among those within <radius> if it's finite.
+// Candidates beyond <threshold>, the <top_n>-th nearest so far, are
+// rejected with one comparison. The others are only appended, and once
+// there are twice as many as needed (or TOPN_SLACK more, if that's more),
+// nth_element() keeps the nearest <top_n> and tightens <threshold>.
+template <typename TDistance, typename TIndex>
+class TopN {
+
+private:
     struct Entry {
         TIndex index;
         TDistance distance;
 
+        // Ties go to the smaller index, so that the result doesn't depend
+        // on the order of pushes.
         bool operator <(const Entry& another) const {
-            return distance < another.distance;
+            return distance < another.distance ||
+                    (distance == another.distance && index < another.index);
         }
     };
-    std::priority_queue<Entry> tops;
-    auto iter = base_vectors.begin();
-    for (size_t i = 0; i < count; i++, iter++) {
-        assert(iter != base_vectors.end());
+
+    size_t top_n;
+    TDistance radius;
+    TDistance threshold;
+    std::vector<Entry> entries;
+
+public:
+    TopN(size_t _top_n, double _radius = HUGE_VAL)
+            : top_n(_top_n), radius(Bound(_radius)), threshold(radius) {}
+
+    void push(TIndex index, TDistance distance) {
+        if (distance > threshold || top_n == 0) {
+            return;
+        }
         Entry entry = {
-            .index = static_cast<TIndex>(i),
-            .distance = dis_algo(*iter, query_vector),
+            .index = index,
+            .distance = distance,
         };
-        tops.push(entry);
-        if (tops.size() > top_n) {
-            tops.pop();
+        entries.push_back(entry);
+        if (entries.size() >= getCapacity()) {
+            settle();
         }
     }
-    assert(tops.size() == top_n);
-    std::vector<TIndex> gt;
-    gt.resize(top_n);
-    size_t rindex = top_n - 1;
-    for (size_t i = 0; i < top_n; i++) {
-        gt[rindex--] = tops.top().index;
-        tops.pop();
+
+    // Pushes <count> candidates numbered from <first>, filtered with SIMD
+    // compares first. <hits> is scratch space for <count> indexes.
+    void push(TIndex first, const TDistance* distances, size_t count,
+            uint32_t* hits) {
+        size_t n = util::simd::Filter(distances, count, threshold, hits);
+        for (size_t i = 0; i < n; i++) {
+            push(static_cast<TIndex>(first + hits[i]), distances[hits[i]]);
+        }
+    }
+
+    // Pushes all the candidates <another> has.
+    void merge(const TopN& another) {
+        for (auto iter = another.entries.begin();
+                iter != another.entries.end(); iter++) {
+            push(iter->index, iter->distance);
+        }
+    }
+
+    // Candidates farther than this are rejected, so their exact distances
+    // don't matter.
+    TDistance getThreshold() const {
+        return top_n == 0 ? Bound(-HUGE_VAL) : threshold;
+    }
+
+    // The nearest first, with their distances in <distances> unless it's
+    // nullptr.
+    std::vector<TIndex> pop(std::vector<float>* distances = nullptr) {
+        settle();
+        std::sort(entries.begin(), entries.end());
+        std::vector<TIndex> gt;
+        gt.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            gt[i] = entries[i].index;
+        }
+        if (distances) {
+            distances->resize(entries.size());
+            for (size_t i = 0; i < entries.size(); i++) {
+                (*distances)[i] = static_cast<float>(entries[i].distance);
+            }
+        }
+        entries.clear();
+        threshold = radius;
+        return gt;
+    }
+
+    bool save(util::vecs::Sidecar& sidecar) const {
+        uint64_t size = entries.size();
+        return sidecar.write(&size, sizeof(size)) &&
+                sidecar.write(entries.data(), sizeof(Entry) * size);
+    }
+
+    bool load(util::vecs::Sidecar& sidecar) {
+        uint64_t size;
+        if (!sidecar.read(&size, sizeof(size)) || size > getCapacity()) {
+            return false;
+        }
+        entries.resize(size);
+        if (!sidecar.read(entries.data(), sizeof(Entry) * size)) {
+            return false;
+        }
+        settle();
+        return true;
+    }
+
+private:
+    size_t getCapacity() const {
+        return top_n + std::max<size_t>(top_n, TOPN_SLACK);
+    }
+
+    // Keeps the nearest <top_n>, if there are more.
+    void settle() {
+        if (top_n == 0 || entries.size() < top_n) {
+            return;
+        }
+        std::nth_element(entries.begin(), entries.begin() + (top_n - 1),
+                entries.end());
+        entries.resize(top_n);
+        threshold = std::min(radius, entries[top_n - 1].distance);
+    }
+
+    // Integer distances are within <radius> as long as they are within its
+    // floor.
+    static TDistance Bound(double radius) {
+        typedef std::numeric_limits<TDistance> limits_t;
+        if (radius >= static_cast<double>(limits_t::max())) {
+            return limits_t::max();
+        }
+        if (radius <= static_cast<double>(limits_t::lowest())) {
+            return limits_t::lowest();
+        }
+        return static_cast<TDistance>(limits_t::is_integer ?
+                std::floor(radius) : radius);
+    }
+
+};
+
+// An existing groundtruth over the first <base_count> vectors of <base>,
+// which an update extends to the vectors appended since then.
+struct Update {
+    size_t base_count;
+    size_t top_n;
+    std::vector<std::vector<int32_t>> ids;
+    struct stat source;
+
+    // All the rows of <gt_fpath> must have the same length, which becomes
+    // <top_n>.
+    void load(const char* gt_fpath, size_t _base_count) {
+        base_count = _base_count;
+        if (stat(gt_fpath, &source) != 0) {
+            throw std::runtime_error("failed to stat <gt>!");
+        }
+        util::vecs::SuffixWrapper gt(gt_fpath, true);
+        if (gt.getDataType() != 'i') {
+            throw std::runtime_error("unsupported format!");
+        }
+        util::vecs::Formater<int32_t> gt_reader(gt.getFile());
+        ids.clear();
+        while (true) {
+            std::vector<int32_t> row = gt_reader.read();
+            if (row.empty()) {
+                break;
+            }
+            if (!ids.empty() && row.size() != top_n) {
+                throw std::runtime_error("rows of <gt> differ in lengths!");
+            }
+            top_n = row.size();
+            for (auto iter = row.begin(); iter != row.end(); iter++) {
+                if (*iter < 0 || (size_t)*iter >= base_count) {
+                    throw std::runtime_error("<gt> refers to vectors beyond "
+                            "<old_base_count>!");
+                }
+            }
+            ids.push_back(std::move(row));
+        }
+        if (ids.empty()) {
+            throw std::runtime_error("<gt> is empty!");
+        }
+    }
+
+};
+
+// The partial results of a sharded run and the number of base vectors done.
+// It's a sidecar of <base>, so that it's ignored once <base> changes, while
+// everything else the results depend on goes into the key.
+class Checkpoint {
+
+private:
+    std::string fpath;
+    std::string key;
+    struct stat source;
+
+public:
+    // <update> is the existing groundtruth of an update, or nullptr.
+    Checkpoint(const char* _fpath, const char* base_fpath,
+            const char* query_fpath, const char* metric_type, size_t top_n,
+            const Options& options, const Update* update) : fpath(_fpath) {
+        struct stat query;
+        if (stat(base_fpath, &source) != 0 || stat(query_fpath, &query) != 0) {
+            throw std::runtime_error("failed to stat <base> or <query>!");
+        }
+        char buf[256];
+        sprintf(buf, "%s %s %lu %.17g %ld %ld.%09ld", metric_type,
+                options.engine.c_str(), top_n, options.radius,
+                (long)query.st_size, (long)query.st_mtim.tv_sec,
+                (long)query.st_mtim.tv_nsec);
+        key = buf;
+        if (update) {
+            sprintf(buf, " update %lu %ld %ld.%09ld", update->base_count,
+                    (long)update->source.st_size,
+                    (long)update->source.st_mtim.tv_sec,
+                    (long)update->source.st_mtim.tv_nsec);
+            key.append(buf);
+        }
     }
-    return gt;
-}
 
+    // Returns the number of base vectors done, or 0 without a valid
+    // checkpoint, in which case <tops> is left untouched.
+    template <typename TTop>
+    size_t load(std::vector<TTop>& tops) {
+        util::vecs::Sidecar sidecar;
+        if (!sidecar.open(fpath.c_str(), CHECKPOINT_MAGIC, source, true)) {
+            return 0;
+        }
+        uint64_t len;
+        std::string saved_key;
+        uint64_t done;
+        uint64_t count;
+        if (!sidecar.read(&len, sizeof(len)) || len != key.length()) {
+            return 0;
+        }
+        saved_key.resize(len);
+        if (!sidecar.read(&saved_key[0], len) || saved_key != key ||
+                !sidecar.read(&done, sizeof(done)) ||
+                !sidecar.read(&count, sizeof(count)) ||
+                count != tops.size()) {
+            return 0;
+        }
+        std::vector<TTop> loaded(tops);
+        for (auto iter = loaded.begin(); iter != loaded.end(); iter++) {
+            if (!iter->load(sidecar)) {
+                return 0;
+            }
+        }
+        tops.swap(loaded);
+        return done;
+    }
+
+    template <typename TTop>
+    void save(size_t done, const std::vector<TTop>& tops) {
+        util::vecs::Sidecar sidecar;
+        uint64_t len = key.length();
+        uint64_t count = tops.size();
+        bool ok = sidecar.open(fpath.c_str(), CHECKPOINT_MAGIC, source,
+                false) && sidecar.write(&len, sizeof(len)) &&
+                sidecar.write(key.data(), len) &&
+                sidecar.write(&done, sizeof(done)) &&
+                sidecar.write(&count, sizeof(count));
+        for (auto iter = tops.begin(); ok && iter != tops.end(); iter++) {
+            ok = iter->save(sidecar);
+        }
+        if (!ok || !sidecar.commit()) {
+            throw std::runtime_error(std::string("failed to save checkpoint "
+                    "to '").append(fpath).append("'!"));
+        }
+    }
+
+    void remove() {
+        unlink(fpath.c_str());
+    }
+
+};
+
+// Compares every query with every base vector with <dis_algo>. The base
+// vectors are the next <count> ones of <base_reader>, numbered from
+// <offset>.
 template <typename TBase, typename TQuery, typename TDistance,
         typename TIndex>
-std::vector<std::vector<TIndex>> Generate(
-        const std::list<std::vector<TBase>>& base_vectors,
-        const std::list<std::vector<TQuery>>& query_vectors,
+class ExactEngine {
+
+public:
+    typedef TopN<TDistance, TIndex> top_t;
+
+private:
+    size_t offset;
+    util::vector::Matrix<TBase> base_vectors;
+    util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo;
+
+public:
+    ExactEngine(util::vecs::Formater<TBase>& base_reader, size_t _offset,
+            size_t count, size_t dim,
+            util::vector::DistanceAlgo<TBase, TQuery, TDistance>& _dis_algo)
+            : offset(_offset), base_vectors(count, dim), dis_algo(_dis_algo) {
+        if (base_reader.readBatch(count, dim, base_vectors.data()) != count) {
+            throw std::runtime_error("broken file of base vectors!");
+        }
+    }
+
+    static size_t getRowSize(size_t dim) {
+        return sizeof(TBase) * dim;
+    }
+
+    size_t getTile() const {
+        return QUERY_TILE;
+    }
+
+    void search(const util::vector::Matrix<TQuery>& query_vectors,
+            size_t begin, size_t end, top_t* tops) {
+        size_t count = base_vectors.size();
+        size_t dim = base_vectors.getDim();
+        size_t tile = std::max<size_t>(1, BASE_TILE /
+                std::max<size_t>(1, getRowSize(dim)));
+        std::vector<TDistance> distances(tile);
+        std::vector<uint32_t> hits(tile);
+        for (size_t first = 0; first < count; first += tile) {
+            size_t last = std::min(count, first + tile);
+            for (size_t i = begin; i < end; i++) {
+                const TQuery* query_vector = query_vectors[i];
+                // L1 and L2 give up on base vectors that can't make it, see
+                // util::simd::Distance().
+                TDistance threshold = tops[i].getThreshold();
+                for (size_t j = first; j < last; j++) {
+                    distances[j - first] = dis_algo(base_vectors[j],
+                            query_vector, dim, threshold);
+                }
+                tops[i].push(static_cast<TIndex>(offset + first),
+                        distances.data(), last - first, hits.data());
+            }
+        }
+    }
+
+};
+
+// Like ExactEngine with util::vector::DistanceCosine, but the inverse norm
+// of each base vector is computed once, when it's loaded, and that of each
+// query once per tile.
+template <typename TBase, typename TQuery, typename TIndex>
+class CosineEngine {
+
+public:
+    typedef TopN<float, TIndex> top_t;
+
+private:
+    typedef util::vector::DistanceCosine<TBase, TQuery> cosine_t;
+
+    size_t offset;
+    util::vector::Matrix<TBase> base_vectors;
+    std::vector<float> inverse_norms;
+
+public:
+    CosineEngine(util::vecs::Formater<TBase>& base_reader, size_t _offset,
+            size_t count, size_t dim)
+            : offset(_offset), base_vectors(count, dim) {
+        if (base_reader.readBatch(count, dim, base_vectors.data()) != count) {
+            throw std::runtime_error("broken file of base vectors!");
+        }
+        inverse_norms.resize(count);
+        for (size_t j = 0; j < count; j++) {
+            inverse_norms[j] = cosine_t::InverseNorm(base_vectors[j], dim);
+        }
+    }
+
+    static size_t getRowSize(size_t dim) {
+        return sizeof(TBase) * dim;
+    }
+
+    size_t getTile() const {
+        return QUERY_TILE;
+    }
+
+    void search(const util::vector::Matrix<TQuery>& query_vectors,
+            size_t begin, size_t end, top_t* tops) {
+        size_t count = base_vectors.size();
+        size_t dim = base_vectors.getDim();
+        std::vector<float> query_inverse_norms;
+        query_inverse_norms.resize(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            query_inverse_norms[i - begin] =
+                    cosine_t::InverseNorm(query_vectors[i], dim);
+        }
+        size_t tile = std::max<size_t>(1, BASE_TILE /
+                std::max<size_t>(1, getRowSize(dim)));
+        std::vector<float> distances(tile);
+        std::vector<uint32_t> hits(tile);
+        for (size_t first = 0; first < count; first += tile) {
+            size_t last = std::min(count, first + tile);
+            for (size_t i = begin; i < end; i++) {
+                const TQuery* query_vector = query_vectors[i];
+                float query_inverse_norm = query_inverse_norms[i - begin];
+                for (size_t j = first; j < last; j++) {
+                    distances[j - first] = cosine_t::Combine(
+                            cosine_t::Product(base_vectors[j], query_vector,
+                            dim), inverse_norms[j], query_inverse_norm);
+                }
+                tops[i].push(static_cast<TIndex>(offset + first),
+                        distances.data(), last - first, hits.data());
+            }
+        }
+    }
+
+};
+
+// Squared L2 distances between uint8 vectors as |x|^2 + |y|^2 - 2 * x.y,
+// with the inner products of util::simd::DotBytesKernel, which takes the
+// query in signed bytes. With y' = y - 128, x.y = x.y' + 128 * sum(x), so
+// each base vector keeps |x|^2 - 256 * sum(x), and each query is converted
+// once per tile. All in integers, so the distances are exactly those of
+// ExactEngine, though none can be abandoned early.
+template <typename TIndex>
+class BytesL2Engine {
+
+public:
+    typedef TopN<int64_t, TIndex> top_t;
+
+private:
+    size_t offset;
+    util::vector::Matrix<uint8_t> base_vectors;
+    std::vector<int64_t> base_terms;
+    util::simd::DotBytesKernel::kernel_t dot;
+
+public:
+    BytesL2Engine(util::vecs::Formater<uint8_t>& base_reader, size_t _offset,
+            size_t count, size_t dim) : offset(_offset),
+            base_vectors(count, dim),
+            dot(util::simd::DotBytesKernel::get()) {
+        if (base_reader.readBatch(count, dim, base_vectors.data()) != count) {
+            throw std::runtime_error("broken file of base vectors!");
+        }
+        base_terms.resize(count);
+        for (size_t j = 0; j < count; j++) {
+            const uint8_t* base_vector = base_vectors[j];
+            int64_t term = 0;
+            for (size_t k = 0; k < dim; k++) {
+                int32_t x = base_vector[k];
+                term += x * x - 256 * x;
+            }
+            base_terms[j] = term;
+        }
+    }
+
+    static size_t getRowSize(size_t dim) {
+        return sizeof(uint8_t) * dim + sizeof(int64_t);
+    }
+
+    size_t getTile() const {
+        return QUERY_TILE;
+    }
+
+    void search(const util::vector::Matrix<uint8_t>& query_vectors,
+            size_t begin, size_t end, top_t* tops) {
+        size_t count = base_vectors.size();
+        size_t dim = base_vectors.getDim();
+        util::vector::Matrix<int8_t> signed_queries(end - begin, dim);
+        std::vector<int64_t> query_norms(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            const uint8_t* query_vector = query_vectors[i];
+            int8_t* signed_query = signed_queries[i - begin];
+            int64_t norm = 0;
+            for (size_t k = 0; k < dim; k++) {
+                int32_t y = query_vector[k];
+                signed_query[k] = static_cast<int8_t>(y - 128);
+                norm += y * y;
+            }
+            query_norms[i - begin] = norm;
+        }
+        size_t tile = std::max<size_t>(1, BASE_TILE /
+                std::max<size_t>(1, getRowSize(dim)));
+        std::vector<int64_t> distances(tile);
+        std::vector<uint32_t> hits(tile);
+        for (size_t first = 0; first < count; first += tile) {
+            size_t last = std::min(count, first + tile);
+            for (size_t i = begin; i < end; i++) {
+                const int8_t* signed_query = signed_queries[i - begin];
+                int64_t query_norm = query_norms[i - begin];
+                for (size_t j = first; j < last; j++) {
+                    distances[j - first] = base_terms[j] + query_norm -
+                            2 * dot(base_vectors[j], signed_query, dim);
+                }
+                tops[i].push(static_cast<TIndex>(offset + first),
+                        distances.data(), last - first, hits.data());
+            }
+        }
+    }
+
+};
+
+// The inner products of a tile of queries and a tile of base vectors are
+// computed together by util::simd::Dot(), all in float. Squared L2
+// distances are then |x|^2 + |y|^2 - 2 * x.y, where the cancellation makes
+// them less precise than those of the exact engine, so near-ties may be
+// ordered differently. IP and cosine distances don't cancel, but still
+// round differently from the exact engine.
+template <typename TBase, typename TQuery, typename TIndex>
+class GemmEngine {
+
+public:
+    typedef TopN<float, TIndex> top_t;
+
+    enum Metric {
+        L2,
+        IP,
+        COS,
+    };
+
+private:
+    Metric metric;
+    size_t offset;
+    size_t count;
+    size_t dim;
+    util::vector::Matrix<float> panels;
+    // Squared norms for L2, inverse norms for COS.
+    std::vector<float> norms;
+
+public:
+    GemmEngine(util::vecs::Formater<TBase>& base_reader, Metric _metric,
+            size_t _offset, size_t _count, size_t _dim)
+            : metric(_metric), offset(_offset), count(_count), dim(_dim),
+            panels((_count + UTIL_SIMD_PANEL - 1) / UTIL_SIMD_PANEL,
+                    _dim * UTIL_SIMD_PANEL) {
+        norms.resize(count);
+        if (panels.size() > 0) {
+            memset(panels[panels.size() - 1], 0,
+                    sizeof(float) * panels.getDim());
+        }
+        util::vector::Matrix<TBase> batch;
+        std::vector<float> buffer;
+        util::vector::Converter<TBase, float> converter;
+        for (size_t i = 0; i < count; i += GEMM_LOAD_BATCH) {
+            size_t n = std::min<size_t>(GEMM_LOAD_BATCH, count - i);
+            batch.resize(n, dim);
+            if (base_reader.readBatch(n, dim, batch.data()) != n) {
+                throw std::runtime_error("broken file of base vectors!");
+            }
+            const float* rows = converter(batch.data(), n * dim, buffer);
+            for (size_t j = 0; j < n; j++) {
+                pack(i + j, rows + j * dim);
+            }
+        }
+    }
+
+    static size_t getRowSize(size_t dim) {
+        return sizeof(float) * dim;
+    }
+
+    size_t getTile() const {
+        return QUERY_TILE;
+    }
+
+    void search(const util::vector::Matrix<TQuery>& query_vectors,
+            size_t begin, size_t end, top_t* tops) {
+        size_t n = end - begin;
+        std::vector<float> buffer;
+        const float* queries = util::vector::Converter<TQuery, float>()
+                (query_vectors[begin], n * dim, buffer);
+        std::vector<float> query_norms;
+        query_norms.resize(n);
+        for (size_t r = 0; r < n; r++) {
+            query_norms[r] = norm(queries + r * dim);
+        }
+        size_t tile = std::max<size_t>(1, BASE_TILE /
+                (sizeof(float) * panels.getDim()));
+        std::vector<float> products;
+        products.resize(n * tile * UTIL_SIMD_PANEL);
+        std::vector<float> distances(tile * UTIL_SIMD_PANEL);
+        std::vector<uint32_t> hits(tile * UTIL_SIMD_PANEL);
+        for (size_t p = 0; p < panels.size(); p += tile) {
+            size_t m = std::min(tile, panels.size() - p);
+            util::simd::Dot(queries, n, panels[p], m, dim, products.data());
+            size_t first = p * UTIL_SIMD_PANEL;
+            size_t width = std::min(m * UTIL_SIMD_PANEL, count - first);
+            for (size_t r = 0; r < n; r++) {
+                const float* dots = products.data() + r * m * UTIL_SIMD_PANEL;
+                for (size_t j = 0; j < width; j++) {
+                    if (metric == L2) {
+                        distances[j] = std::max(query_norms[r] +
+                                norms[first + j] - 2 * dots[j], 0.0f);
+                    }
+                    else if (metric == IP) {
+                        distances[j] = -dots[j];
+                    }
+                    else {
+                        distances[j] = 1 - dots[j] * query_norms[r] *
+                                norms[first + j];
+                    }
+                }
+                tops[begin + r].push(static_cast<TIndex>(offset + first),
+                        distances.data(), width, hits.data());
+            }
+        }
+    }
+
+private:
+    void pack(size_t index, const float* row) {
+        float* panel = panels[index / UTIL_SIMD_PANEL];
+        size_t j = index % UTIL_SIMD_PANEL;
+        for (size_t k = 0; k < dim; k++) {
+            panel[k * UTIL_SIMD_PANEL + j] = row[k];
+        }
+        norms[index] = norm(row);
+    }
+
+    float norm(const float* row) const {
+        float sum = 0;
+        for (size_t k = 0; k < dim; k++) {
+            sum += row[k] * row[k];
+        }
+        if (metric == COS) {
+            return sum > 0 ? 1 / std::sqrt(sum) : 0;
+        }
+        return sum;
+    }
+
+};
+
+// Reads all the remaining vectors of <reader>, which must have <dim>
+// dimensions.
+template <typename T>
+void ReadAll(util::vecs::Formater<T>& reader, size_t dim,
+        util::vector::Matrix<T>& vectors) {
+    std::vector<T> elements;
+    util::vector::Matrix<T> batch(GEMM_LOAD_BATCH, dim);
+    while (size_t n = reader.readBatch(GEMM_LOAD_BATCH, dim, batch.data())) {
+        elements.insert(elements.end(), batch.data(),
+                batch.data() + n * dim);
+    }
+    vectors.resize(dim > 0 ? elements.size() / dim : 0, dim);
+    memcpy(vectors.data(), elements.data(), sizeof(T) * elements.size());
+}
+
+// Pushes the neighbours of <update> into tops[i] for each query i, with
+// their distances recomputed by <dis_algo>. Each base vector is read once,
+// in the order of the file, however many queries it is a neighbour of.
+template <typename TBase, typename TQuery, typename TDistance, typename TTop>
+void Seed(util::vecs::Formater<TBase>& base_reader,
         util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n, size_t thread_count) {
-    if (thread_count == 0) {
-        throw std::runtime_error("<thread_count = 0> is invalid!");
-    }
-    size_t count = query_vectors.size();
-    std::vector<std::vector<TIndex>> gts;
-    gts.resize(count);
-    auto iter = query_vectors.begin();
-    size_t cursor = 0;
+        const Update& update,
+        const util::vector::Matrix<TQuery>& query_vectors, TTop* tops) {
+    if (update.ids.size() != query_vectors.size()) {
+        throw std::runtime_error("<gt> and <query> differ in counts!");
+    }
+    size_t dim = query_vectors.getDim();
+    std::vector<std::pair<int32_t, size_t>> neighbours;
+    for (size_t i = 0; i < update.ids.size(); i++) {
+        for (auto iter = update.ids[i].begin(); iter != update.ids[i].end();
+                iter++) {
+            neighbours.emplace_back(*iter, i);
+        }
+    }
+    std::sort(neighbours.begin(), neighbours.end());
+    util::vector::Matrix<TBase> base_vector(1, dim);
+    int32_t loaded = -1;
+    for (auto iter = neighbours.begin(); iter != neighbours.end(); iter++) {
+        if (iter->first != loaded) {
+            if (loaded < 0 || iter->first != loaded + 1) {
+                base_reader.seek(iter->first);
+            }
+            if (base_reader.readBatch(1, dim, base_vector.data()) != 1) {
+                throw std::runtime_error("broken file of base vectors!");
+            }
+            loaded = iter->first;
+        }
+        tops[iter->second].push(iter->first, dis_algo(base_vector[0],
+                query_vectors[iter->second], dim));
+    }
+}
+
+// Writes the ids of <tops> to <gt_writer>, and their distances to
+// <dist_writer> unless it's nullptr.
+template <typename TTop, typename TIndex>
+void Write(std::vector<TTop>& tops, util::vecs::Formater<TIndex>& gt_writer,
+        util::vecs::Formater<float>* dist_writer) {
+    std::vector<float> distances;
+    for (auto iter = tops.begin(); iter != tops.end(); iter++) {
+        gt_writer.write(iter->pop(dist_writer ? &distances : nullptr));
+        if (dist_writer) {
+            dist_writer->write(distances);
+        }
+    }
+}
+
+// <thread_count> threads that search one batch of queries after another.
+// Each batch is cut into tiles of up to engine.getTile() queries, smaller
+// ones when there are too few queries to keep all threads busy, and a tile
+// is claimed with one atomic increment. A thread that finds no tile left
+// moves on to the next batch right away, so the tail of a batch overlaps
+// with the next one instead of leaving threads idle. The results of query
+// i of a batch are pushed into its tops[i].
+//
+// With <numa> on a machine of several NUMA nodes, the threads are split
+// into one group per node, bound to its CPUs, and so are the base vectors,
+// which each group loads into the memory of its node. Every group searches
+// all the queries, but only its own base vectors, so that base vectors are
+// never read across nodes. The last group to finish a tile merges the
+// results of the others into <tops>.
+template <typename TQuery, typename TEngine>
+class Scheduler {
+
+public:
+    typedef typename TEngine::top_t top_t;
+
+private:
+    struct Group {
+        std::vector<int> cpus;
+        // Threads [first, first + thread_count) belong to this group.
+        size_t first;
+        size_t thread_count;
+        // nullptr if this group has no base vectors.
+        std::unique_ptr<TEngine> engine;
+    };
+
+    struct Part {
+        TEngine* engine;
+        // The results of this group, merged into <tops> of the batch tile by
+        // tile. Empty for the first group, which pushes into those directly.
+        std::vector<top_t> tops;
+        std::atomic<size_t> cursor;
+    };
+
+    struct Batch {
+        const util::vector::Matrix<TQuery>* query_vectors;
+        top_t* tops;
+        size_t tile;
+        std::unique_ptr<Part[]> parts;
+        // The number of groups done with each tile.
+        std::unique_ptr<std::atomic<size_t>[]> finished;
+        size_t active;
+        // The threads that have found no tile left, guarded by <mutex>.
+        size_t left;
+    };
+
+    size_t thread_count;
+    top_t blank;
+    std::vector<Group> groups;
+    // Batches in submission order, until all threads have left them.
+    std::deque<std::unique_ptr<Batch>> batches;
+    // The number of batches already removed from <batches>.
+    size_t removed;
+    bool stopping;
     std::mutex mutex;
+    std::condition_variable changed;
     std::vector<std::thread> threads;
-    for (size_t i = 0; i < thread_count; i++) {
-        threads.emplace_back([&] {
+
+public:
+    // Results start as copies of <_blank>.
+    Scheduler(size_t _thread_count, const top_t& _blank, bool numa)
+            : thread_count(_thread_count), blank(_blank), removed(0),
+            stopping(false) {
+        if (thread_count == 0) {
+            throw std::runtime_error("<thread_count = 0> is invalid!");
+        }
+        std::vector<std::vector<int>> nodes;
+        if (numa) {
+            nodes = util::numa::Nodes();
+        }
+        if (nodes.size() < 2 || nodes.size() > thread_count) {
+            nodes.assign(1, std::vector<int>());
+        }
+        groups.resize(nodes.size());
+        for (size_t g = 0; g < groups.size(); g++) {
+            groups[g].cpus = nodes[g];
+            groups[g].first = thread_count * g / groups.size();
+            groups[g].thread_count = thread_count * (g + 1) / groups.size() -
+                    groups[g].first;
+        }
+        for (size_t g = 0; g < groups.size(); g++) {
+            for (size_t i = 0; i < groups[g].thread_count; i++) {
+                threads.emplace_back([this, g] {
+                    util::numa::Binding binding(groups[g].cpus);
+                    work(g);
+                });
+            }
+        }
+    }
+
+    // Drops the tiles not claimed yet, after an error.
+    ~Scheduler() {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        for (auto iter = batches.begin(); iter != batches.end(); iter++) {
+            for (size_t g = 0; g < groups.size(); g++) {
+                (*iter)->parts[g].cursor = (*iter)->query_vectors->size();
+            }
+        }
+        changed.notify_all();
+        lock.unlock();
+        for (size_t i = 0; i < thread_count; i++) {
+            threads[i].join();
+        }
+    }
+
+    // Replaces the engines with ones created by <factory>(offset, count)
+    // for the next <count> base vectors. They are split among the groups in
+    // proportion to their threads, and each group creates its engine on its
+    // own CPUs, so that the base vectors are placed on its node when they
+    // are first touched. No batch may be in flight.
+    void load(const std::function<TEngine*(size_t, size_t)>& factory,
+            size_t offset, size_t count) {
+        assert(batches.empty());
+        for (size_t g = 0; g < groups.size(); g++) {
+            groups[g].engine.reset();
+        }
+        for (size_t g = 0; g < groups.size(); g++) {
+            Group& group = groups[g];
+            size_t begin = count * group.first / thread_count;
+            size_t end = count * (group.first + group.thread_count) /
+                    thread_count;
+            if (begin < end) {
+                util::numa::Binding binding(group.cpus);
+                group.engine.reset(factory(offset + begin, end - begin));
+            }
+        }
+    }
+
+    // Returns at once. <query_vectors> and <tops> must stay valid until
+    // wait() returns for this batch.
+    void submit(const util::vector::Matrix<TQuery>& query_vectors,
+            top_t* tops) {
+        size_t count = query_vectors.size();
+        std::unique_ptr<Batch> batch(new Batch);
+        batch->query_vectors = &query_vectors;
+        batch->tops = tops;
+        batch->tile = count;
+        batch->parts.reset(new Part[groups.size()]);
+        batch->active = 0;
+        batch->left = 0;
+        for (size_t g = 0; g < groups.size(); g++) {
+            Part& part = batch->parts[g];
+            part.engine = groups[g].engine.get();
+            part.cursor = part.engine ? 0 : count;
+            if (!part.engine) {
+                continue;
+            }
+            if (g > 0) {
+                part.tops.assign(count, blank);
+            }
+            batch->tile = std::min(batch->tile, std::min(
+                    part.engine->getTile(), (count + groups[g].thread_count -
+                    1) / groups[g].thread_count));
+            batch->active++;
+        }
+        batch->tile = std::max<size_t>(1, batch->tile);
+        size_t tiles = (count + batch->tile - 1) / batch->tile;
+        batch->finished.reset(new std::atomic<size_t>[tiles]);
+        for (size_t i = 0; i < tiles; i++) {
+            batch->finished[i] = 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        batches.push_back(std::move(batch));
+        changed.notify_all();
+    }
+
+    // Waits until the oldest batch not waited for is done.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        assert(!batches.empty());
+        changed.wait(lock, [this] {
+            return batches.front()->left == thread_count;
+        });
+        batches.pop_front();
+        removed++;
+    }
+
+private:
+    void work(size_t g) {
+        // The sequence number of the batch to work on.
+        size_t next = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this, next] {
+                return stopping || next < removed + batches.size();
+            });
+            if (stopping) {
+                return;
+            }
+            Batch& batch = *batches[next - removed];
+            lock.unlock();
+            Part& part = batch.parts[g];
+            top_t* tops = g > 0 ? part.tops.data() : batch.tops;
+            size_t count = batch.query_vectors->size();
             while (true) {
-                mutex.lock();
-                size_t index = cursor;
-                if (index >= count) {
-                    mutex.unlock();
+                size_t begin = part.cursor.fetch_add(batch.tile);
+                if (begin >= count) {
                     break;
                 }
-                assert(iter != query_vectors.end());
-                const std::vector<TQuery>& vector = *iter;
-                iter++;
-                cursor++;
-                mutex.unlock();
-                gts[index] = Generate<TBase, TQuery, TDistance, TIndex>
-                        (base_vectors, vector, dis_algo, top_n);
+                size_t end = std::min(count, begin + batch.tile);
+                part.engine->search(*batch.query_vectors, begin, end, tops);
+                if (batch.finished[begin / batch.tile].fetch_add(1) + 1 ==
+                        batch.active) {
+                    merge(batch, begin, end);
+                }
             }
-        });
-    }
-    for (size_t i = 0; i < thread_count; i++) {
-        threads[i].join();
+            lock.lock();
+            if (++batch.left == thread_count) {
+                changed.notify_all();
+            }
+            next++;
+        }
     }
-    assert(cursor == count);
-    assert(iter == query_vectors.end());
-    return gts;
-}
 
-template <typename TBase, typename TQuery, typename TDistance,
-        typename TIndex>
-void Generate(util::vecs::File* gt_file,
-        util::vecs::File* base_file, util::vecs::File* query_file,
-        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n, size_t thread_count) {
-    util::vecs::Formater<TBase> base_reader(base_file);
-    std::list<std::vector<TBase>> base_vectors;
-    while (true) {
-        std::vector<TBase> vector = base_reader.read();
-        if (vector.size() == 0) {
-            break;
+    void merge(Batch& batch, size_t begin, size_t end) {
+        for (size_t g = 1; g < groups.size(); g++) {
+            std::vector<top_t>& tops = batch.parts[g].tops;
+            if (tops.empty()) {
+                continue;
+            }
+            for (size_t i = begin; i < end; i++) {
+                batch.tops[i].merge(tops[i]);
+                tops[i] = blank;
+            }
         }
-        base_vectors.emplace_back(std::move(vector));
     }
-    size_t batch_size = thread_count * 1000;
+
+};
+
+// <factory>(offset, count) creates an engine for the next <count> base
+// vectors. If the base vectors don't fit in <shard_size> bytes (0 for no
+// limit), they are loaded one shard after another, and all the queries are
+// kept in memory with their partial results in between. Since ties are
+// broken by index, the results are the same either way. A <checkpoint>
+// implies shards, and resumes from the last one saved. An update starts
+// from the base vector <first>, with the results <seed>(queries, tops)
+// already has for the ones before it. The distances go to <dist_file>
+// unless it's nullptr.
+template <typename TQuery, typename TIndex, typename TEngine>
+void Generate(util::vecs::File* gt_file, util::vecs::File* dist_file,
+        util::vecs::File* query_file,
+        const std::function<TEngine*(size_t, size_t)>& factory,
+        const std::function<void(size_t)>& seek,
+        const std::function<void(const util::vector::Matrix<TQuery>&,
+                typename TEngine::top_t*)>& seed, size_t first,
+        size_t count, size_t dim, size_t top_n, double radius,
+        size_t thread_count, bool numa, size_t shard_size,
+        Checkpoint* checkpoint) {
+    typedef typename TEngine::top_t top_t;
+    if (checkpoint && shard_size == 0) {
+        shard_size = CHECKPOINT_SHARD;
+    }
+    size_t shard = count;
+    if (shard_size > 0) {
+        shard = std::max<size_t>(1, shard_size /
+                std::max<size_t>(1, TEngine::getRowSize(dim)));
+    }
     util::vecs::Formater<TQuery> query_reader(query_file);
     util::vecs::Formater<TIndex> gt_writer(gt_file);
-    while (true) {
-        std::list<std::vector<TQuery>> query_vectors;
-        for (size_t i = 0; i < batch_size; i++) {
-            std::vector<TQuery> vector = query_reader.read();
-            if (vector.size() == 0) {
-                break;
+    std::unique_ptr<util::vecs::Formater<float>> dist_writer;
+    if (dist_file) {
+        dist_writer.reset(new util::vecs::Formater<float>(dist_file));
+    }
+    if (shard >= count && !checkpoint && first == 0) {
+        // Each batch is searched while the previous one is finishing, and
+        // written while the next one is searched.
+        size_t batch_size = thread_count * 1000;
+        util::vecs::ReadAhead<util::vector::Matrix<TQuery>> query_batches(
+                [&](util::vector::Matrix<TQuery>& query_vectors) {
+            query_vectors.resize(batch_size, dim);
+            size_t n = query_reader.readBatch(batch_size, dim,
+                    query_vectors.data());
+            query_vectors.resize(n, dim);
+            return n > 0;
+        }, UTIL_VECS_READAHEAD_DEPTH, 2);
+        std::vector<top_t> tops[2];
+        Scheduler<TQuery, TEngine> scheduler(thread_count,
+                top_t(top_n, radius), numa);
+        scheduler.load(factory, 0, count);
+        size_t submitted = 0;
+        while (util::vector::Matrix<TQuery>* query_vectors =
+                query_batches.next()) {
+            std::vector<top_t>& current = tops[submitted++ % 2];
+            current.assign(query_vectors->size(), top_t(top_n, radius));
+            scheduler.submit(*query_vectors, current.data());
+            if (submitted > 1) {
+                scheduler.wait();
+                Write(tops[submitted % 2], gt_writer, dist_writer.get());
             }
-            query_vectors.emplace_back(std::move(vector));
         }
-        if (query_vectors.size() == 0) {
-            break;
+        if (submitted > 0) {
+            scheduler.wait();
+            Write(tops[(submitted - 1) % 2], gt_writer, dist_writer.get());
         }
-        std::vector<std::vector<TIndex>> gts = Generate
-                <TBase, TQuery, TDistance, TIndex>
-                (base_vectors, query_vectors, dis_algo, top_n, thread_count);
-        for (auto iter = gts.begin(); iter != gts.end(); iter++) {
-            gt_writer.write(*iter);
+        return;
+    }
+    util::vector::Matrix<TQuery> query_vectors;
+    ReadAll(query_reader, dim, query_vectors);
+    std::vector<top_t> tops(query_vectors.size(), top_t(top_n, radius));
+    size_t offset = checkpoint ? checkpoint->load(tops) : 0;
+    if (offset == 0 && first > 0) {
+        seed(query_vectors, tops.data());
+        offset = first;
+    }
+    if (offset > 0) {
+        seek(offset);
+    }
+    Scheduler<TQuery, TEngine> scheduler(thread_count, top_t(top_n, radius),
+            numa);
+    while (offset < count) {
+        size_t n = std::min(shard, count - offset);
+        scheduler.load(factory, offset, n);
+        scheduler.submit(query_vectors, tops.data());
+        scheduler.wait();
+        offset += n;
+        if (checkpoint && offset < count) {
+            checkpoint->save(offset, tops);
         }
     }
+    Write(tops, gt_writer, dist_writer.get());
 }
 
+// Runs BytesL2Engine for 'l2' between uint8 vectors, where the CPU has
+// VNNI. Returns false otherwise.
 template <typename TBase, typename TQuery, typename TDistance,
         typename TIndex>
-void Generate(util::vecs::File* gt_file,
-        util::vecs::File* base_file, util::vecs::File* query_file,
-        const char* metric_type, size_t top_n, size_t thread_count) {
-    std::unique_ptr<util::vector::DistanceAlgo<TBase, TQuery, TDistance>> algo;
+bool GenerateBytesL2(util::vecs::File* gt_file, util::vecs::File* dist_file,
+        util::vecs::File* query_file,
+        util::vecs::Formater<TBase>& base_reader,
+        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& algo,
+        size_t first, size_t count, size_t dim, size_t top_n,
+        size_t thread_count, const Options& options, const Update* update,
+        Checkpoint* checkpoint, std::true_type) {
+    if (!util::simd::CPU::vnni()) {
+        return false;
+    }
+    typedef BytesL2Engine<TIndex> engine_t;
+    Generate<TQuery, TIndex, engine_t>(gt_file, dist_file, query_file,
+            [&](size_t offset, size_t n) {
+        return new engine_t(base_reader, offset, n, dim);
+    }, [&](size_t offset) {
+        base_reader.seek(offset);
+    }, [&](const util::vector::Matrix<TQuery>& query_vectors,
+            typename engine_t::top_t* tops) {
+        Seed(base_reader, algo, *update, query_vectors, tops);
+    }, first, count, dim, top_n, options.radius, thread_count,
+            options.numa, options.shard_size, checkpoint);
+    return true;
+}
+
+template <typename TBase, typename TQuery, typename TDistance,
+        typename TIndex>
+bool GenerateBytesL2(util::vecs::File* gt_file, util::vecs::File* dist_file,
+        util::vecs::File* query_file,
+        util::vecs::Formater<TBase>& base_reader,
+        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& algo,
+        size_t first, size_t count, size_t dim, size_t top_n,
+        size_t thread_count, const Options& options, const Update* update,
+        Checkpoint* checkpoint, std::false_type) {
+    return false;
+}
+
+template <typename TBase, typename TQuery, typename TDistance>
+util::vector::DistanceAlgo<TBase, TQuery, TDistance>* NewCosine(
+        std::true_type) {
+    return new util::vector::DistanceCosine<TBase, TQuery>;
+}
+
+template <typename TBase, typename TQuery, typename TDistance>
+util::vector::DistanceAlgo<TBase, TQuery, TDistance>* NewCosine(
+        std::false_type) {
+    throw std::runtime_error("cosine distances must be float!");
+}
+
+template <typename TBase, typename TQuery, typename TDistance>
+util::vector::DistanceAlgo<TBase, TQuery, TDistance>* NewDistanceAlgo(
+        const char* metric_type) {
     if (strcmp(metric_type, "l1") == 0) {
-        algo.reset(new util::vector::DistanceL1<TBase, TQuery, TDistance>);
+        return new util::vector::DistanceL1<TBase, TQuery, TDistance>;
     }
-    else if (strcmp(metric_type, "l2") == 0) {
-        algo.reset(new util::vector::DistanceL2Sqr<TBase, TQuery, TDistance>);
+    if (strcmp(metric_type, "l2") == 0) {
+        return new util::vector::DistanceL2Sqr<TBase, TQuery, TDistance>;
     }
-    else {
-        throw std::runtime_error(std::string("unsupported metric type: '")
-                .append(metric_type).append("'!"));
+    if (strcmp(metric_type, "ip") == 0) {
+        return new util::vector::DistanceIP<TBase, TQuery, TDistance>;
     }
-    Generate<TBase, TQuery, TDistance, TIndex>(gt_file, base_file,
-            query_file, *algo, top_n, thread_count);
+    if (strcmp(metric_type, "cos") == 0) {
+        return NewCosine<TBase, TQuery, TDistance>(
+                std::is_same<TDistance, float>());
+    }
+    throw std::runtime_error(std::string("unsupported metric type: '")
+            .append(metric_type).append("'!"));
 }
 
-void Generate(const char* gt_fpath, const char* base_fpath,
-        const char* query_fpath, const char* metric_type,
-        size_t top_n, size_t thread_count) {
+template <typename TBase, typename TQuery, typename TDistance,
+        typename TIndex>
+void Generate(util::vecs::File* gt_file, util::vecs::File* dist_file,
+        util::vecs::File* base_file, const util::vecs::Catalog& base_catalog,
+        util::vecs::File* query_file, const char* metric_type,
+        size_t top_n, size_t thread_count, const Options& options,
+        const Update* update, Checkpoint* checkpoint) {
+    size_t count = base_catalog.size();
+    size_t dim = base_catalog.getDim();
+    if (top_n > count && std::isinf(options.radius)) {
+        char buf[256];
+        sprintf(buf, "argument <top_n = %lu> is larger than vector count!",
+                top_n);
+        throw std::runtime_error(buf);
+    }
+    if (count > 0 && dim == 0) {
+        throw std::runtime_error("vectors of <base> differ in dimensions!");
+    }
+    if (strcmp(metric_type, "cos") == 0 &&
+            !std::is_same<TDistance, float>::value) {
+        // Cosine distances are float, whatever the vectors are.
+        Generate<TBase, TQuery, float, TIndex>(gt_file, dist_file,
+                base_file, base_catalog, query_file, metric_type, top_n,
+                thread_count, options, update, checkpoint);
+        return;
+    }
+    size_t first = update ? update->base_count : 0;
+    if (first > count) {
+        throw std::runtime_error("<old_base_count> is larger than vector "
+                "count!");
+    }
+    util::vecs::Formater<TBase> base_reader(base_file, &base_catalog);
+    auto seek = [&](size_t offset) {
+        base_reader.seek(offset);
+    };
+    std::unique_ptr<util::vector::DistanceAlgo<TBase, TQuery, TDistance>> algo(
+            NewDistanceAlgo<TBase, TQuery, TDistance>(metric_type));
+    bool cosine = strcmp(metric_type, "cos") == 0;
+    if (options.engine == "gemm") {
+        typedef GemmEngine<TBase, TQuery, TIndex> engine_t;
+        typename engine_t::Metric metric = cosine ? engine_t::COS :
+                strcmp(metric_type, "ip") == 0 ? engine_t::IP : engine_t::L2;
+        if (strcmp(metric_type, "l1") == 0 ||
+                !std::is_same<TDistance, float>::value) {
+            throw std::runtime_error("engine 'gemm' only supports 'l2', "
+                    "'ip' and 'cos' with float vectors in <base> or "
+                    "<query>!");
+        }
+        Generate<TQuery, TIndex, engine_t>(gt_file, dist_file, query_file,
+                [&](size_t offset, size_t n) {
+            return new engine_t(base_reader, metric, offset, n, dim);
+        }, seek, [&](const util::vector::Matrix<TQuery>& query_vectors,
+                typename engine_t::top_t* tops) {
+            Seed(base_reader, *algo, *update, query_vectors, tops);
+        }, first, count, dim, top_n, options.radius, thread_count,
+                options.numa, options.shard_size, checkpoint);
+        return;
+    }
+    if (cosine) {
+        typedef CosineEngine<TBase, TQuery, TIndex> engine_t;
+        Generate<TQuery, TIndex, engine_t>(gt_file, dist_file, query_file,
+                [&](size_t offset, size_t n) {
+            return new engine_t(base_reader, offset, n, dim);
+        }, seek, [&](const util::vector::Matrix<TQuery>& query_vectors,
+                typename engine_t::top_t* tops) {
+            Seed(base_reader, *algo, *update, query_vectors, tops);
+        }, first, count, dim, top_n, options.radius, thread_count,
+                options.numa, options.shard_size, checkpoint);
+        return;
+    }
+    if (strcmp(metric_type, "l2") == 0 &&
+            GenerateBytesL2<TBase, TQuery, TDistance, TIndex>(gt_file,
+            dist_file, query_file, base_reader, *algo, first, count, dim,
+            top_n, thread_count, options, update, checkpoint,
+            std::integral_constant<bool, std::is_same<TBase, uint8_t>::value &&
+            std::is_same<TQuery, uint8_t>::value>())) {
+        return;
+    }
+    typedef ExactEngine<TBase, TQuery, TDistance, TIndex> engine_t;
+    Generate<TQuery, TIndex, engine_t>(gt_file, dist_file, query_file,
+            [&](size_t offset, size_t n) {
+        return new engine_t(base_reader, offset, n, dim, *algo);
+    }, seek, [&](const util::vector::Matrix<TQuery>& query_vectors,
+            typename engine_t::top_t* tops) {
+        Seed(base_reader, *algo, *update, query_vectors, tops);
+    }, first, count, dim, top_n, options.radius, thread_count,
+            options.numa, options.shard_size, checkpoint);
+}
+
+void Generate(const char* gt_fpath, const char* dist_fpath,
+        const char* base_fpath, const char* query_fpath,
+        const char* metric_type, size_t top_n, size_t thread_count,
+        const Options& options, const Update* update,
+        Checkpoint* checkpoint) {
     util::vecs::SuffixWrapper base(base_fpath, true);
     util::vecs::SuffixWrapper query(query_fpath, true);
     util::vecs::SuffixWrapper gt(gt_fpath, false);
-    typedef void (*func_t)(
-            util::vecs::File*, util::vecs::File*, util::vecs::File*,
-            const char*, size_t, size_t);
+    std::unique_ptr<util::vecs::SuffixWrapper> dist;
+    if (dist_fpath) {
+        dist.reset(new util::vecs::SuffixWrapper(dist_fpath, false));
+        if (dist->getDataType() != 'f') {
+            throw std::runtime_error("unsupported format of distances!");
+        }
+    }
+    typedef void (*func_t)(util::vecs::File*, util::vecs::File*,
+            util::vecs::File*, const util::vecs::Catalog&, util::vecs::File*, const char*,
+            size_t, size_t, const Options&, const Update*, Checkpoint*);
     static const struct Entry {
         char base_type;
         char query_type;
@@ -172,12 +1299,19 @@ void Generate(const char* gt_fpath, const char* base_fpath,
     }
     entries[] = {
         {'b', 'b', 'i', Generate<uint8_t, uint8_t, int64_t, int32_t>},
+        {'b', 'c', 'i', Generate<uint8_t, int8_t, int64_t, int32_t>},
         {'b', 'i', 'i', Generate<uint8_t, int32_t, int64_t, int32_t>},
         {'b', 'f', 'i', Generate<uint8_t, float, float, int32_t>},
+        {'c', 'b', 'i', Generate<int8_t, uint8_t, int64_t, int32_t>},
+        {'c', 'c', 'i', Generate<int8_t, int8_t, int64_t, int32_t>},
+        {'c', 'i', 'i', Generate<int8_t, int32_t, int64_t, int32_t>},
+        {'c', 'f', 'i', Generate<int8_t, float, float, int32_t>},
         {'i', 'b', 'i', Generate<int32_t, uint8_t, int64_t, int32_t>},
+        {'i', 'c', 'i', Generate<int32_t, int8_t, int64_t, int32_t>},
         {'i', 'i', 'i', Generate<int32_t, int32_t, int64_t, int32_t>},
         {'i', 'f', 'i', Generate<int32_t, float, float, int32_t>},
         {'f', 'b', 'i', Generate<float, uint8_t, float, int32_t>},
+        {'f', 'c', 'i', Generate<float, int8_t, float, int32_t>},
         {'f', 'i', 'i', Generate<float, int32_t, float, int32_t>},
         {'f', 'f', 'i', Generate<float, float, float, int32_t>},
     };
@@ -186,29 +1320,168 @@ void Generate(const char* gt_fpath, const char* base_fpath,
         if (base.getDataType() == entry->base_type &&
                 query.getDataType() == entry->query_type &&
                 gt.getDataType() == entry->gt_type) {
-            entry->func(gt.getFile(), base.getFile(), query.getFile(),
-                    metric_type, top_n, thread_count);
+            entry->func(gt.getFile(), dist ? dist->getFile() : nullptr,
+                    base.getFile(), base.getCatalog(),
+                    query.getFile(), metric_type, top_n, thread_count,
+                    options, update, checkpoint);
             return;
         }
     }
     throw std::runtime_error("unsupported format!");
 }
 
+// Writes to <fpath>, or with <replace>, to a temporary file next to it,
+// which commit() renames into place, so that an existing file is never
+// left half written.
+class Output {
+
+private:
+    std::string fpath;
+    std::string tmp_fpath;
+
+public:
+    Output(const std::string& _fpath, bool replace) : fpath(_fpath) {
+        if (replace) {
+            size_t pos = fpath.rfind('/');
+            pos = pos == std::string::npos ? 0 : pos + 1;
+            tmp_fpath = fpath;
+            tmp_fpath.insert(pos, std::string(".")
+                    .append(std::to_string(getpid())).append("."));
+        }
+    }
+
+    ~Output() {
+        if (!tmp_fpath.empty()) {
+            unlink(tmp_fpath.c_str());
+            unlink((tmp_fpath + UTIL_VECS_GZINDEX_SUFFIX).c_str());
+        }
+    }
+
+    const char* getPath() const {
+        return tmp_fpath.empty() ? fpath.c_str() : tmp_fpath.c_str();
+    }
+
+    void commit() {
+        if (tmp_fpath.empty()) {
+            return;
+        }
+        if (rename(tmp_fpath.c_str(), fpath.c_str()) != 0) {
+            throw std::runtime_error(std::string("failed to replace '")
+                    .append(fpath).append("'!"));
+        }
+        // A rename keeps the mtime, so the index of a .gz output stays valid.
+        rename((tmp_fpath + UTIL_VECS_GZINDEX_SUFFIX).c_str(),
+                (fpath + UTIL_VECS_GZINDEX_SUFFIX).c_str());
+        tmp_fpath.clear();
+    }
+
+};
+
+// The checkpoint is removed only after the outputs are closed. An update
+// reads <gt> in full before replacing it.
+void Generate(const char* gt_fpath, const char* base_fpath,
+        const char* query_fpath, const char* metric_type,
+        size_t top_n, size_t thread_count, const Options& options,
+        const Update* update) {
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (!options.checkpoint.empty()) {
+        checkpoint.reset(new Checkpoint(options.checkpoint.c_str(),
+                base_fpath, query_fpath, metric_type, top_n, options,
+                update));
+    }
+    Output gt(gt_fpath, update);
+    std::unique_ptr<Output> dist;
+    if (!options.dist.empty()) {
+        dist.reset(new Output(options.dist, update));
+    }
+    Generate(gt.getPath(), dist ? dist->getPath() : nullptr, base_fpath,
+            query_fpath, metric_type, top_n, thread_count, options, update,
+            checkpoint.get());
+    gt.commit();
+    if (dist) {
+        dist->commit();
+    }
+    if (checkpoint) {
+        checkpoint->remove();
+    }
+}
+
+int UpdateMain(int argc, char** argv) {
+    size_t base_count;
+    size_t thread_count;
+    if ((argc != 8 && argc != 9) || sscanf(argv[3], "%lu", &base_count) != 1 ||
+            sscanf(argv[7], "%lu", &thread_count) != 1) {
+        fprintf(stderr, "%s update <gt> <old_base_count> <base> <query> "
+                "<metric> <thread> [options]\n"
+                "Update the groundtruth <gt> of <query>, computed when <base> "
+                "had only its first <old_base_count> vectors, to the whole "
+                "<base>. Only the vectors appended since then are scanned. "
+                "<metric>, <thread> and [options] are the same as without "
+                "'update', while <top_n> is that of <gt>.\n",
+                argv[0]);
+        return 1;
+    }
+    const char* gt = argv[2];
+    const char* base = argv[4];
+    const char* query = argv[5];
+    const char* metric = argv[6];
+    try {
+        Options options;
+        if (argc == 9) {
+            options.parse(argv[8]);
+        }
+        // The rows of a range search differ in lengths, so <top_n> can't
+        // be told from <gt>.
+        if (!std::isinf(options.radius)) {
+            throw std::runtime_error("option 'radius' is not supported by "
+                    "update!");
+        }
+        Update update;
+        update.load(gt, base_count);
+        Generate(gt, base, query, metric, update.top_n, thread_count,
+                options, &update);
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "update") == 0) {
+        return UpdateMain(argc, argv);
+    }
     size_t top_n;
     size_t thread_count;
-    if (argc != 7 || sscanf(argv[5], "%lu", &top_n) != 1 ||
+    if ((argc != 7 && argc != 8) || sscanf(argv[5], "%lu", &top_n) != 1 ||
             sscanf(argv[6], "%lu", &thread_count) != 1) {
-        fprintf(stderr, "%s <gt> <base> <query> <metric> <top_n> <thread>\n"
+        fprintf(stderr, "%s <gt> <base> <query> <metric> <top_n> <thread> "
+                "[options]\n"
                 "Calculate the groundtruth for vectors in <query>. "
                 "For each vector in <query>, find the <top_n> nearest vectors"
                 " from <base>. Output result to <gt>. Use <metric> to "
-                "calculate the distances, now 'l1' and 'l2' are supported. "
+                "calculate the distances, now 'l1', 'l2', 'ip' (inner "
+                "product) and 'cos' (cosine) are supported. "
                 "Accelerate the process with <thread> threads. "
                 "The formats of <base> and <query> can be any combination "
-                "of .[b/i/f]vecs.(gz). While the format of <gt> should be "
-                ".ivecs or .ivecs.gz.\n",
-                argv[0]);
+                "of .[b/i/f]vecs.(gz/zst/lz4) and .[u8/i8/i/f]bin.(gz/zst/lz4)."
+                " While the format of <gt> should be .ivecs.(gz/zst/lz4) "
+                "or .ibin. [options] is a comma-split string of key=value "
+                "pairs, e.g. 'engine=gemm' computes 'l2' groundtruth of "
+                "float vectors with matrix multiplications, much faster but "
+                "slightly less precise than the default 'engine=exact'. "
+                "And 'shard=64G' loads at most 64GB of <base> at a time, "
+                "for a <base> larger than the memory. 'dist=<path>' writes "
+                "the distances to the neighbours in <gt> to a .fvecs or "
+                ".fbin file at <path>. 'radius=<r>' keeps only the "
+                "neighbours within distance <r>, at most <top_n> of them, "
+                "so the rows of <gt> differ in lengths. On a machine of "
+                "several NUMA nodes, each node searches the part of <base> "
+                "in its own memory, unless 'numa=off'. "
+                "Run '%s update' for the usage of updating an existing <gt> "
+                "after vectors are appended to <base>.\n",
+                argv[0], argv[0]);
         return 1;
     }
     const char* gt = argv[1];
@@ -216,7 +1489,12 @@ int main(int argc, char** argv) {
     const char* query = argv[3];
     const char* metric = argv[4];
     try {
-        Generate(gt, base, query, metric, top_n, thread_count);
+        Options options;
+        if (argc == 8) {
+            options.parse(argv[7]);
+        }
+        Generate(gt, base, query, metric, top_n, thread_count, options,
+                nullptr);
     }
     catch (const std::exception& e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
@@ -10,50 +10,45 @@
 template <typename T>
 std::shared_ptr<faiss::Index> Build(const char* key,
         const char* parameters, util::vecs::File* base_file,
-        float train_ratio) {
-    util::vecs::Formater<T> reader(base_file);
-    size_t dim = reader.read().size();
+        const util::vecs::Catalog& base_catalog, float train_ratio) {
+    util::vecs::Formater<T> reader(base_file, &base_catalog);
+    size_t dim;
+    reader.view(dim);
     if (dim == 0) {
         throw std::runtime_error("empty file of base vectors!");
     }
-    size_t base_count = 1;
-    while (reader.skip()) {
-        base_count++;
-    }
-    reader.reset();
+    size_t base_count = reader.count();
     size_t train_count = std::min<>(base_count,
             std::max<>(1UL, (size_t)(base_count * train_ratio)));
     float* train_vectors = new float[dim * train_count];
     std::unique_ptr<float> train_vectors_deleter(train_vectors);
-    size_t cursor = 0;
     util::random::Sequence<size_t> seq_rand(0, base_count, train_count);
-    util::vector::Converter<T, float> converter;
     for (size_t i = 0; i < train_count; i++) {
-        size_t index = seq_rand.next();
-        while (cursor < index) {
-            reader.skip();
-            cursor++;
-        }
-        assert(cursor == index);
-        std::vector<T> vector = reader.read();
-        cursor++;
-        converter(train_vectors + dim * i, vector);
+        reader.seek(seq_rand.next());
+        reader.readBatchConverted(1, dim, train_vectors + dim * i);
     }
-    assert(cursor <= base_count);
     reader.reset();
     std::shared_ptr<faiss::Index> index(faiss::index_factory(dim, key));
     faiss::ParameterSpace().set_index_parameters(index.get(), parameters);
     index->train(train_count, train_vectors);
     train_vectors_deleter.reset();
-    for (size_t i = 0; i < base_count; i++) {
-        std::vector<T> vector = reader.read();
-        if (vector.size() != dim) {
-            char buf[256];
-            sprintf(buf, "index is %luD, but this vector is %luD!",
-                    dim, vector.size());
-            throw std::runtime_error(buf);
+    size_t batch_size = std::max<>(1UL,
+            (64UL << 20) / (dim * sizeof(float)));
+    util::vecs::ReadAhead<std::vector<float>> batches(
+            [&](std::vector<float>& batch) {
+        batch.resize(batch_size * dim);
+        size_t n = reader.readBatchConverted(batch_size, dim, batch.data());
+        batch.resize(n * dim);
+        return n > 0;
+    });
+    for (size_t i = 0; i < base_count; ) {
+        std::vector<float>* batch = batches.next();
+        if (!batch) {
+            throw std::runtime_error("broken file of base vectors!");
         }
-        index->add(1, converter(vector).data());
+        size_t n = std::min<>(batch->size() / dim, base_count - i);
+        index->add(n, batch->data());
+        i += n;
     }
     return index;
 }
@@ -65,13 +60,15 @@ void Build(const char* fpath, const char* key,
                 .append("' already exists!"));
     }
     typedef std::shared_ptr<faiss::Index> (*func_t)(const char*,
-            const char*, util::vecs::File*, float);
+            const char*, util::vecs::File*, const util::vecs::Catalog&,
+            float);
     static const struct Entry {
         char type;
         func_t func;
     }
     entries[] = {
         {'b', Build<uint8_t>},
+        {'c', Build<int8_t>},
         {'i', Build<int>},
         {'f', Build<float>},
     };
@@ -80,7 +77,8 @@ void Build(const char* fpath, const char* key,
     for (size_t i = 0; i < sizeof(entries) / sizeof(Entry); i++) {
         const Entry* entry = entries + i;
         if (base.getDataType() == entry->type) {
-            index = entry->func(key, parameters, base.getFile(), train_ratio);
+            index = entry->func(key, parameters, base.getFile(),
+                    base.getCatalog(), train_ratio);
             faiss::write_index(index.get(), fpath);
             return;
         }
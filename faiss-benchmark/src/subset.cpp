@@ -3,43 +3,35 @@
 #include "util/vector.h"
 
 template <typename TSrc, typename TDst>
-void Extract(util::vecs::File* src_file, util::vecs::File* dst_file,
+void Extract(util::vecs::File* src_file,
+        const util::vecs::Catalog& src_catalog, util::vecs::File* dst_file,
         size_t count) {
-    util::vecs::Formater<TSrc> reader(src_file);
-    size_t icount = 0;
-    while (reader.skip()) {
-        icount++;
-    }
+    util::vecs::Formater<TSrc> reader(src_file, &src_catalog);
+    size_t icount = reader.count();
     if (count > icount) {
         char buf[256];
         sprintf(buf, "argument <count = %lu> is larger than vector count!",
                 count);
         throw std::runtime_error(buf);
     }
-    reader.reset();
-    size_t cursor = 0;
     util::random::Sequence<size_t> seq_rand(0, icount, count);
     util::vecs::Formater<TDst> writer(dst_file);
     util::vector::Converter<TSrc, TDst> converter;
+    std::vector<TDst> buffer;
     for (size_t i = 0; i < count; i++) {
-        size_t index = seq_rand.next();
-        while (cursor < index) {
-            reader.skip();
-            cursor++;
-        }
-        assert(cursor == index);
-        std::vector<TSrc> vector = reader.read();
-        cursor++;
-        assert(vector.size() > 0);
-        writer.write(converter(vector));
+        reader.seek(seq_rand.next());
+        size_t dim;
+        const TSrc* vector = reader.view(dim);
+        assert(vector);
+        writer.write(converter(vector, dim, buffer), dim);
     }
-    assert(cursor <= icount);
 }
 
 void Extract(const char* src_fpath, const char* dst_fpath, size_t count) {
     util::vecs::SuffixWrapper src(src_fpath, true);
     util::vecs::SuffixWrapper dst(dst_fpath, false);
-    typedef void (*func_t)(util::vecs::File*, util::vecs::File*, size_t);
+    typedef void (*func_t)(util::vecs::File*, const util::vecs::Catalog&,
+            util::vecs::File*, size_t);
     static const struct Entry {
         char src_type;
         char dst_type;
@@ -47,12 +39,19 @@ void Extract(const char* src_fpath, const char* dst_fpath, size_t count) {
     }
     entries[] = {
         {'b', 'b', Extract<uint8_t, uint8_t>},
+        {'b', 'c', Extract<uint8_t, int8_t>},
         {'b', 'i', Extract<uint8_t, int32_t>},
         {'b', 'f', Extract<uint8_t, float>},
+        {'c', 'b', Extract<int8_t, uint8_t>},
+        {'c', 'c', Extract<int8_t, int8_t>},
+        {'c', 'i', Extract<int8_t, int32_t>},
+        {'c', 'f', Extract<int8_t, float>},
         {'i', 'b', Extract<int32_t, uint8_t>},
+        {'i', 'c', Extract<int32_t, int8_t>},
         {'i', 'i', Extract<int32_t, int32_t>},
         {'i', 'f', Extract<int32_t, float>},
         {'f', 'b', Extract<float, uint8_t>},
+        {'f', 'c', Extract<float, int8_t>},
         {'f', 'i', Extract<float, int32_t>},
         {'f', 'f', Extract<float, float>},
     };
@@ -60,7 +59,8 @@ void Extract(const char* src_fpath, const char* dst_fpath, size_t count) {
         const Entry* entry = entries + i;
         if (src.getDataType() == entry->src_type &&
                 dst.getDataType() == entry->dst_type) {
-            entry->func(src.getFile(), dst.getFile(), count);
+            entry->func(src.getFile(), src.getCatalog(), dst.getFile(),
+                    count);
             return;
         }
     }
@@ -73,7 +73,8 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%s <src> <dst> <n>\n"
                 "Extract <n> vectors randomly from <src> to <dst>. "
                 "The formats of <src> and <dst> can be any combination of"
-                " .[b/i/f]vecs.(gz).\n",
+                " .[b/i/f]vecs.(gz/zst/lz4) and .[u8/i8/i/f]bin.(gz/zst/lz4)"
+                ", except that .bin outputs can't be compressed.\n",
                 argv[0]);
         return 1;
     }
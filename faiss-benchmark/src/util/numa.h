@@ -0,0 +1,140 @@
+#ifndef UTIL_NUMA_H
+#define UTIL_NUMA_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "string.h"
+
+#define UTIL_NUMA_NODE_DIR      "/sys/devices/system/node"
+
+namespace util {
+
+namespace numa {
+
+// Binds the calling thread to <cpus> while it lives, and then restores the
+// old binding. Nothing changes with empty <cpus>, or where binding fails,
+// which only costs speed.
+class Binding {
+
+private:
+    cpu_set_t old;
+    bool bound;
+
+public:
+    Binding(const std::vector<int>& cpus) : bound(false) {
+        if (cpus.empty()) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        bound = sched_getaffinity(0, sizeof(old), &old) == 0 &&
+                sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    Binding(const Binding&) = delete;
+
+    Binding& operator =(const Binding&) = delete;
+
+    ~Binding() {
+        if (bound) {
+            sched_setaffinity(0, sizeof(old), &old);
+        }
+    }
+
+};
+
+// The first line of <fpath>, or "" if it can't be read.
+inline std::string ReadLine(const char* fpath) {
+    std::string line;
+    FILE* file = fopen(fpath, "r");
+    if (!file) {
+        return line;
+    }
+    char buf[4096];
+    if (fgets(buf, sizeof(buf), file)) {
+        line = buf;
+    }
+    fclose(file);
+    while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) {
+        line.pop_back();
+    }
+    return line;
+}
+
+// A list like "0-3,8-11", as in sysfs. Returns an empty list if it's
+// malformed.
+inline std::vector<int> ParseList(const std::string& list) {
+    std::vector<int> items;
+    auto func = [&items](const char* str, size_t len) -> int {
+        std::string range(str, len);
+        int first;
+        int last;
+        char tail;
+        int n = sscanf(range.c_str(), "%d-%d%c", &first, &last, &tail);
+        if (n == 1) {
+            last = first;
+        }
+        else if (n != 2 || first > last) {
+            return -1;
+        }
+        for (int item = first; item <= last; item++) {
+            items.push_back(item);
+        }
+        return 0;
+    };
+    if (list.empty() || util::string::split(list.c_str(), ",", &func)) {
+        items.clear();
+    }
+    return items;
+}
+
+// The CPUs that this process may run on, grouped by NUMA node, as listed in
+// sysfs. Nodes without any of them (like memory-only ones) are left out.
+// Without NUMA information, all of them make one node.
+inline std::vector<std::vector<int>> Nodes() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        throw std::runtime_error("sched_getaffinity() failed!");
+    }
+    std::vector<std::vector<int>> nodes;
+    std::vector<int> online = ParseList(ReadLine(UTIL_NUMA_NODE_DIR
+            "/online"));
+    for (int node : online) {
+        char fpath[256];
+        sprintf(fpath, UTIL_NUMA_NODE_DIR "/node%d/cpulist", node);
+        std::vector<int> cpus;
+        for (int cpu : ParseList(ReadLine(fpath))) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(cpus);
+        }
+    }
+    if (nodes.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,1182 @@
+#ifndef UTIL_SIMD_H
+#define UTIL_SIMD_H
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <type_traits>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+// GCC 12 warns about the intentionally undefined registers that the
+// AVX-512 intrinsics start from.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define UTIL_SIMD_X86
+#endif
+
+#define UTIL_SIMD_LEVEL_ENV     "SIMD_LEVEL"
+
+#define UTIL_SIMD_LANES         16
+#define UTIL_SIMD_BLOCK         4096
+#define UTIL_SIMD_PANEL         16
+#define UTIL_SIMD_CHECK         64
+
+// Contraction into FMA is off, since it would round differently from the
+// scalar code.
+#define UTIL_SIMD_AVX2          __attribute__((target("avx2"),            \
+                                        optimize("fp-contract=off")))
+#define UTIL_SIMD_AVX512        __attribute__((target("avx512f,avx512bw"),\
+                                        optimize("fp-contract=off")))
+#define UTIL_SIMD_AVX2_FMA      __attribute__((target("avx2,fma")))
+#define UTIL_SIMD_AVX512_FMA    __attribute__((target("avx512f,avx512bw")))
+#define UTIL_SIMD_AVX2_VNNI     __attribute__((target("avx2,avxvnni")))
+#define UTIL_SIMD_AVX512_VNNI   __attribute__((target("avx512f,avx512bw," \
+                                        "avx512vnni")))
+
+namespace util {
+
+namespace simd {
+
+enum Level {
+    SCALAR,
+    AVX2,
+    AVX512,
+};
+
+class CPU {
+
+public:
+    // The widest instruction set that the CPU supports, detected once. It
+    // can be lowered (for comparisons, or to avoid AVX-512 downclocking) by
+    // setting UTIL_SIMD_LEVEL_ENV to "scalar" or "avx2".
+    static Level level() {
+        static Level level = detect();
+        return level;
+    }
+
+    // Whether there are VNNI instructions (vpdpbusd) at level().
+    static bool vnni() {
+        static bool vnni = detectVNNI();
+        return vnni;
+    }
+
+private:
+    static Level detect() {
+        Level level = SCALAR;
+#ifdef UTIL_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512bw")) {
+            level = AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("fma")) {
+            level = AVX2;
+        }
+#endif
+        const char* limit = getenv(UTIL_SIMD_LEVEL_ENV);
+        if (limit && strcmp(limit, "scalar") == 0) {
+            level = SCALAR;
+        }
+        else if (limit && strcmp(limit, "avx2") == 0 && level > AVX2) {
+            level = AVX2;
+        }
+        return level;
+    }
+
+    static bool detectVNNI() {
+#ifdef UTIL_SIMD_X86
+        switch (level()) {
+            case AVX512:
+                return __builtin_cpu_supports("avx512vnni");
+            case AVX2:
+                return __builtin_cpu_supports("avxvnni");
+            default:
+                break;
+        }
+#endif
+        return false;
+    }
+
+};
+
+template <typename TSrc, typename TDst>
+inline void Convert(TDst* dst, const TSrc* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = static_cast<TDst>(src[i]);
+    }
+}
+
+// Out of range values (and NaN, as 0) saturate, the same at every level.
+inline void ConvertScalar(uint8_t* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float value = src[i];
+        dst[i] = value >= 255 ? 255 : value > 0 ? (uint8_t)value : 0;
+    }
+}
+
+#ifdef UTIL_SIMD_X86
+
+UTIL_SIMD_AVX2
+inline void ConvertAVX2(float* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i value = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(value));
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX512
+inline void ConvertAVX512(float* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i value = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i*)(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_cvtepi32_ps(value));
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX2
+inline void ConvertAVX2(float* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(value));
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX512
+inline void ConvertAVX512(float* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i value = _mm512_loadu_si512(src + i);
+        _mm512_storeu_ps(dst + i, _mm512_cvtepi32_ps(value));
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX2
+inline void ConvertAVX2(uint8_t* dst, const float* src, size_t count) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(255);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i values[4];
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        for (size_t j = 0; j < 4; j++) {
+            // max() returns its second operand for NaN.
+            __m256 value = _mm256_max_ps(_mm256_loadu_ps(src + i + j * 8),
+                    zero);
+            values[j] = _mm256_cvttps_epi32(_mm256_min_ps(value, max));
+        }
+        // Both packs work within 128-bit lanes, hence the permutation.
+        __m256i packed = _mm256_packus_epi16(
+                _mm256_packus_epi32(values[0], values[1]),
+                _mm256_packus_epi32(values[2], values[3]));
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                _mm256_permutevar8x32_epi32(packed, order));
+    }
+    ConvertScalar(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX512
+inline void ConvertAVX512(uint8_t* dst, const float* src, size_t count) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 max = _mm512_set1_ps(255);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 value = _mm512_max_ps(_mm512_loadu_ps(src + i), zero);
+        value = _mm512_min_ps(value, max);
+        _mm_storeu_si128((__m128i*)(dst + i),
+                _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(value)));
+    }
+    ConvertScalar(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX2
+inline void ConvertAVX2(int64_t* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i value = _mm256_cvtepi32_epi64(
+                _mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), value);
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+UTIL_SIMD_AVX512
+inline void ConvertAVX512(int64_t* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i value = _mm512_cvtepi32_epi64(
+                _mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm512_storeu_si512(dst + i, value);
+    }
+    Convert(dst + i, src + i, count - i);
+}
+
+#endif
+
+// The kernels are chosen by CPU::level() once, on the first call.
+#ifdef UTIL_SIMD_X86
+#define UTIL_SIMD_DISPATCH(TSrc, TDst, scalar)                             \
+inline void Convert(TDst* dst, const TSrc* src, size_t count) {            \
+    typedef void (*kernel_t)(TDst*, const TSrc*, size_t);                  \
+    static const kernel_t kernels[] = {                                    \
+        scalar,                                                            \
+        ConvertAVX2,                                                       \
+        ConvertAVX512,                                                     \
+    };                                                                     \
+    static const kernel_t kernel = kernels[CPU::level()];                  \
+    kernel(dst, src, count);                                               \
+}
+#else
+#define UTIL_SIMD_DISPATCH(TSrc, TDst, scalar)                             \
+inline void Convert(TDst* dst, const TSrc* src, size_t count) {            \
+    scalar(dst, src, count);                                               \
+}
+#endif
+
+UTIL_SIMD_DISPATCH(uint8_t, float, (Convert<uint8_t, float>))
+UTIL_SIMD_DISPATCH(int32_t, float, (Convert<int32_t, float>))
+UTIL_SIMD_DISPATCH(float, uint8_t, ConvertScalar)
+UTIL_SIMD_DISPATCH(int32_t, int64_t, (Convert<int32_t, int64_t>))
+
+#undef UTIL_SIMD_DISPATCH
+
+// IP is the negative inner product, so that the nearer is the smaller for
+// every metric.
+enum Metric {
+    L1,
+    L2,
+    IP,
+};
+
+// What a pair of elements adds to the distance.
+template <Metric metric, typename T>
+inline T Term(T a, T b) {
+    if (metric == IP) {
+        return -(a * b);
+    }
+    T delta = a - b;
+    return metric == L2 ? delta * delta : std::abs(delta);
+}
+
+// Every kernel takes a <bound>, which only the <bounded> ones look at. They
+// compare the partial sum with it every UTIL_SIMD_CHECK elements, and
+// return the partial sum as soon as it exceeds <bound>. L1 and L2 terms are
+// never negative, and rounding is monotonic, so a partial sum never exceeds
+// the full one: what a bounded kernel returns is above <bound> exactly when
+// the distance is, and is the distance otherwise. IP terms can be
+// negative, so IP is never bounded.
+template <Metric metric, typename TV1, typename TV2, typename TResult,
+        bool bounded>
+inline TResult Distance(const TV1* v1, const TV2* v2, size_t dim,
+        TResult bound) {
+    TResult sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        sum += Term<metric>(static_cast<TResult>(v1[i]),
+                static_cast<TResult>(v2[i]));
+        if (bounded && (i + 1) % UTIL_SIMD_CHECK == 0 && sum > bound) {
+            return sum;
+        }
+    }
+    return sum;
+}
+
+// Float distances are summed into UTIL_SIMD_LANES interleaved partial sums,
+// reduced pairwise at the end, and never with FMA. Every level follows that
+// order exactly, so the result doesn't depend on the CPU.
+inline float Reduce(float* lanes) {
+    for (size_t width = UTIL_SIMD_LANES / 2; width > 0; width /= 2) {
+        for (size_t i = 0; i < width; i++) {
+            lanes[i] += lanes[i + width];
+        }
+    }
+    return lanes[0];
+}
+
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+inline float DistanceScalar(const TV1* v1, const TV2* v2, size_t dim,
+        float bound) {
+    float lanes[UTIL_SIMD_LANES] = {0};
+    for (size_t i = 0; i < dim; i++) {
+        lanes[i % UTIL_SIMD_LANES] += Term<metric>(
+                static_cast<float>(v1[i]), static_cast<float>(v2[i]));
+        if (bounded && (i + 1) % UTIL_SIMD_CHECK == 0) {
+            float partial[UTIL_SIMD_LANES];
+            memcpy(partial, lanes, sizeof(lanes));
+            float sum = Reduce(partial);
+            if (sum > bound) {
+                return sum;
+            }
+        }
+    }
+    return Reduce(lanes);
+}
+
+#ifdef UTIL_SIMD_X86
+
+// Loads 8 elements as floats.
+UTIL_SIMD_AVX2
+inline __m256 LoadPS256(const float* src) {
+    return _mm256_loadu_ps(src);
+}
+
+UTIL_SIMD_AVX2
+inline __m256 LoadPS256(const int32_t* src) {
+    return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)src));
+}
+
+UTIL_SIMD_AVX2
+inline __m256 LoadPS256(const uint8_t* src) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)src)));
+}
+
+UTIL_SIMD_AVX2
+inline __m256 LoadPS256(const int8_t* src) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+            _mm_loadl_epi64((const __m128i*)src)));
+}
+
+// Loads 4 integers as int64.
+UTIL_SIMD_AVX2
+inline __m256i LoadQ256(const int32_t* src) {
+    return _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)src));
+}
+
+UTIL_SIMD_AVX2
+inline __m256i LoadQ256(const uint8_t* src) {
+    int32_t value;
+    memcpy(&value, src, sizeof(value));
+    return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(value));
+}
+
+UTIL_SIMD_AVX2
+inline __m256i LoadQ256(const int8_t* src) {
+    int32_t value;
+    memcpy(&value, src, sizeof(value));
+    return _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(value));
+}
+
+// Loads 16 bytes as int16.
+UTIL_SIMD_AVX2
+inline __m256i LoadW256(const uint8_t* src) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)src));
+}
+
+UTIL_SIMD_AVX2
+inline __m256i LoadW256(const int8_t* src) {
+    return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)src));
+}
+
+// The low 64 bits of the product, like the scalar (wrapping) product.
+UTIL_SIMD_AVX2
+inline __m256i MulQ256(__m256i a, __m256i b) {
+    __m256i cross = _mm256_add_epi64(
+            _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)),
+            _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+            _mm256_slli_epi64(cross, 32));
+}
+
+UTIL_SIMD_AVX2
+inline __m256i AbsQ256(__m256i value) {
+    __m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), value);
+    return _mm256_sub_epi64(_mm256_xor_si256(value, sign), sign);
+}
+
+template <Metric metric>
+UTIL_SIMD_AVX2
+inline __m256 TermPS256(__m256 a, __m256 b) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    if (metric == IP) {
+        return _mm256_xor_ps(_mm256_mul_ps(a, b), sign);
+    }
+    __m256 delta = _mm256_sub_ps(a, b);
+    return metric == L2 ? _mm256_mul_ps(delta, delta) :
+            _mm256_andnot_ps(sign, delta);
+}
+
+template <Metric metric>
+UTIL_SIMD_AVX2
+inline __m256i TermQ256(__m256i a, __m256i b) {
+    if (metric == IP) {
+        return _mm256_sub_epi64(_mm256_setzero_si256(), MulQ256(a, b));
+    }
+    __m256i delta = _mm256_sub_epi64(a, b);
+    return metric == L2 ? MulQ256(delta, delta) : AbsQ256(delta);
+}
+
+// Pairs of int16 terms summed in int32, with IP as a * -b.
+template <Metric metric>
+UTIL_SIMD_AVX2
+inline __m256i TermW256(__m256i a, __m256i b) {
+    if (metric == IP) {
+        return _mm256_madd_epi16(a,
+                _mm256_sub_epi16(_mm256_setzero_si256(), b));
+    }
+    __m256i delta = _mm256_sub_epi16(a, b);
+    return metric == L2 ? _mm256_madd_epi16(delta, delta) :
+            _mm256_madd_epi16(_mm256_abs_epi16(delta), _mm256_set1_epi16(1));
+}
+
+// Reduce() of lanes 0 to 7 in <low> and 8 to 15 in <high>, in registers.
+UTIL_SIMD_AVX2
+inline float ReducePS256(__m256 low, __m256 high) {
+    __m256 sum = _mm256_add_ps(low, high);
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(sum),
+            _mm256_extractf128_ps(sum, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+UTIL_SIMD_AVX2
+inline int64_t ReduceQ256(__m256i value) {
+    __m128i x = _mm_add_epi64(_mm256_castsi256_si128(value),
+            _mm256_extracti128_si256(value, 1));
+    return _mm_cvtsi128_si64(_mm_add_epi64(x, _mm_unpackhi_epi64(x, x)));
+}
+
+// Sign-extends the int32 lanes of <value> and adds them to <sum>.
+UTIL_SIMD_AVX2
+inline __m256i WidenQ256(__m256i sum, __m256i value) {
+    return _mm256_add_epi64(sum, _mm256_add_epi64(
+            _mm256_cvtepi32_epi64(_mm256_castsi256_si128(value)),
+            _mm256_cvtepi32_epi64(_mm256_extracti128_si256(value, 1))));
+}
+
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX2
+inline float DistanceAVX2(const TV1* v1, const TV2* v2, size_t dim,
+        float bound) {
+    __m256 sums[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    while (i + UTIL_SIMD_LANES <= dim) {
+        for (size_t j = 0; j < 2; j++) {
+            sums[j] = _mm256_add_ps(sums[j], TermPS256<metric>(
+                    LoadPS256(v1 + i + j * 8), LoadPS256(v2 + i + j * 8)));
+        }
+        i += UTIL_SIMD_LANES;
+        if (bounded && i % UTIL_SIMD_CHECK == 0) {
+            float sum = ReducePS256(sums[0], sums[1]);
+            if (sum > bound) {
+                return sum;
+            }
+        }
+    }
+    float lanes[UTIL_SIMD_LANES];
+    _mm256_storeu_ps(lanes, sums[0]);
+    _mm256_storeu_ps(lanes + 8, sums[1]);
+    for (; i < dim; i++) {
+        lanes[i % UTIL_SIMD_LANES] += Term<metric>(
+                static_cast<float>(v1[i]), static_cast<float>(v2[i]));
+    }
+    return Reduce(lanes);
+}
+
+// For 32-bit integers, exact (modulo 2^64) in int64 lanes.
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX2
+inline int64_t DistanceQAVX2(const TV1* v1, const TV2* v2, size_t dim,
+        int64_t bound) {
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 4 <= dim) {
+        sum = _mm256_add_epi64(sum, TermQ256<metric>(LoadQ256(v1 + i),
+                LoadQ256(v2 + i)));
+        i += 4;
+        if (bounded && i % UTIL_SIMD_CHECK == 0) {
+            int64_t partial = ReduceQ256(sum);
+            if (partial > bound) {
+                return partial;
+            }
+        }
+    }
+    return ReduceQ256(sum) + Distance<metric, TV1, TV2, int64_t, false>(
+            v1 + i, v2 + i, dim - i, 0);
+}
+
+// For bytes, in int16 deltas (or elements, for IP) whose products are
+// summed in int32, widened to int64 before they could overflow.
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX2
+inline int64_t DistanceWAVX2(const TV1* v1, const TV2* v2, size_t dim,
+        int64_t bound) {
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 16 <= dim) {
+        size_t end = std::min(dim, i + 16 * UTIL_SIMD_BLOCK);
+        __m256i block = _mm256_setzero_si256();
+        while (i + 16 <= end) {
+            block = _mm256_add_epi32(block, TermW256<metric>(
+                    LoadW256(v1 + i), LoadW256(v2 + i)));
+            i += 16;
+            if (bounded && i % UTIL_SIMD_CHECK == 0) {
+                int64_t partial = ReduceQ256(WidenQ256(sum, block));
+                if (partial > bound) {
+                    return partial;
+                }
+            }
+        }
+        sum = WidenQ256(sum, block);
+    }
+    return ReduceQ256(sum) + Distance<metric, TV1, TV2, int64_t, false>(
+            v1 + i, v2 + i, dim - i, 0);
+}
+
+// Loads 16 elements as floats.
+UTIL_SIMD_AVX512
+inline __m512 LoadPS512(const float* src) {
+    return _mm512_loadu_ps(src);
+}
+
+UTIL_SIMD_AVX512
+inline __m512 LoadPS512(const int32_t* src) {
+    return _mm512_cvtepi32_ps(_mm512_loadu_si512(src));
+}
+
+UTIL_SIMD_AVX512
+inline __m512 LoadPS512(const uint8_t* src) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)src)));
+}
+
+UTIL_SIMD_AVX512
+inline __m512 LoadPS512(const int8_t* src) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+            _mm_loadu_si128((const __m128i*)src)));
+}
+
+// Loads 8 integers as int64.
+UTIL_SIMD_AVX512
+inline __m512i LoadQ512(const int32_t* src) {
+    return _mm512_cvtepi32_epi64(_mm256_loadu_si256((const __m256i*)src));
+}
+
+UTIL_SIMD_AVX512
+inline __m512i LoadQ512(const uint8_t* src) {
+    return _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i*)src));
+}
+
+UTIL_SIMD_AVX512
+inline __m512i LoadQ512(const int8_t* src) {
+    return _mm512_cvtepi8_epi64(_mm_loadl_epi64((const __m128i*)src));
+}
+
+// Loads 32 bytes as int16.
+UTIL_SIMD_AVX512
+inline __m512i LoadW512(const uint8_t* src) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)src));
+}
+
+UTIL_SIMD_AVX512
+inline __m512i LoadW512(const int8_t* src) {
+    return _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)src));
+}
+
+UTIL_SIMD_AVX512
+inline __m512i MulQ512(__m512i a, __m512i b) {
+    __m512i cross = _mm512_add_epi64(
+            _mm512_mul_epu32(a, _mm512_srli_epi64(b, 32)),
+            _mm512_mul_epu32(_mm512_srli_epi64(a, 32), b));
+    return _mm512_add_epi64(_mm512_mul_epu32(a, b),
+            _mm512_slli_epi64(cross, 32));
+}
+
+// The sign is flipped in integer registers, since _mm512_xor_ps() needs
+// AVX512DQ.
+template <Metric metric>
+UTIL_SIMD_AVX512
+inline __m512 TermPS512(__m512 a, __m512 b) {
+    if (metric == IP) {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(
+                _mm512_mul_ps(a, b)), _mm512_set1_epi32(INT32_MIN)));
+    }
+    __m512 delta = _mm512_sub_ps(a, b);
+    return metric == L2 ? _mm512_mul_ps(delta, delta) : _mm512_abs_ps(delta);
+}
+
+template <Metric metric>
+UTIL_SIMD_AVX512
+inline __m512i TermQ512(__m512i a, __m512i b) {
+    if (metric == IP) {
+        return _mm512_sub_epi64(_mm512_setzero_si512(), MulQ512(a, b));
+    }
+    __m512i delta = _mm512_sub_epi64(a, b);
+    return metric == L2 ? MulQ512(delta, delta) : _mm512_abs_epi64(delta);
+}
+
+template <Metric metric>
+UTIL_SIMD_AVX512
+inline __m512i TermW512(__m512i a, __m512i b) {
+    if (metric == IP) {
+        return _mm512_madd_epi16(a,
+                _mm512_sub_epi16(_mm512_setzero_si512(), b));
+    }
+    __m512i delta = _mm512_sub_epi16(a, b);
+    return metric == L2 ? _mm512_madd_epi16(delta, delta) :
+            _mm512_madd_epi16(_mm512_abs_epi16(delta), _mm512_set1_epi16(1));
+}
+
+UTIL_SIMD_AVX512
+inline int64_t ReduceQ512(__m512i value) {
+    int64_t lanes[8];
+    _mm512_storeu_si512(lanes, value);
+    int64_t sum = 0;
+    for (size_t i = 0; i < 8; i++) {
+        sum += lanes[i];
+    }
+    return sum;
+}
+
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX512
+inline float DistanceAVX512(const TV1* v1, const TV2* v2, size_t dim,
+        float bound) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    while (i + UTIL_SIMD_LANES <= dim) {
+        sum = _mm512_add_ps(sum, TermPS512<metric>(LoadPS512(v1 + i),
+                LoadPS512(v2 + i)));
+        i += UTIL_SIMD_LANES;
+        if (bounded && i % UTIL_SIMD_CHECK == 0) {
+            float partial = ReducePS256(_mm512_castps512_ps256(sum),
+                    _mm256_castpd_ps(_mm512_extractf64x4_pd(
+                    _mm512_castps_pd(sum), 1)));
+            if (partial > bound) {
+                return partial;
+            }
+        }
+    }
+    float lanes[UTIL_SIMD_LANES];
+    _mm512_storeu_ps(lanes, sum);
+    for (; i < dim; i++) {
+        lanes[i % UTIL_SIMD_LANES] += Term<metric>(
+                static_cast<float>(v1[i]), static_cast<float>(v2[i]));
+    }
+    return Reduce(lanes);
+}
+
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX512
+inline int64_t DistanceQAVX512(const TV1* v1, const TV2* v2, size_t dim,
+        int64_t bound) {
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    while (i + 8 <= dim) {
+        sum = _mm512_add_epi64(sum, TermQ512<metric>(LoadQ512(v1 + i),
+                LoadQ512(v2 + i)));
+        i += 8;
+        if (bounded && i % UTIL_SIMD_CHECK == 0) {
+            int64_t partial = _mm512_reduce_add_epi64(sum);
+            if (partial > bound) {
+                return partial;
+            }
+        }
+    }
+    return ReduceQ512(sum) + Distance<metric, TV1, TV2, int64_t, false>(
+            v1 + i, v2 + i, dim - i, 0);
+}
+
+// Sign-extends the odd and the even int32 lanes of <value> in place, and
+// adds them to <sum>.
+UTIL_SIMD_AVX512
+inline __m512i WidenQ512(__m512i sum, __m512i value) {
+    return _mm512_add_epi64(sum, _mm512_add_epi64(
+            _mm512_srai_epi64(value, 32),
+            _mm512_srai_epi64(_mm512_slli_epi64(value, 32), 32)));
+}
+
+template <Metric metric, typename TV1, typename TV2, bool bounded>
+UTIL_SIMD_AVX512
+inline int64_t DistanceWAVX512(const TV1* v1, const TV2* v2, size_t dim,
+        int64_t bound) {
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    while (i + 32 <= dim) {
+        size_t end = std::min(dim, i + 32 * UTIL_SIMD_BLOCK);
+        __m512i block = _mm512_setzero_si512();
+        while (i + 32 <= end) {
+            block = _mm512_add_epi32(block, TermW512<metric>(
+                    LoadW512(v1 + i), LoadW512(v2 + i)));
+            i += 32;
+            if (bounded && i % UTIL_SIMD_CHECK == 0) {
+                int64_t partial = _mm512_reduce_add_epi64(
+                        WidenQ512(sum, block));
+                if (partial > bound) {
+                    return partial;
+                }
+            }
+        }
+        sum = WidenQ512(sum, block);
+    }
+    return ReduceQ512(sum) + Distance<metric, TV1, TV2, int64_t, false>(
+            v1 + i, v2 + i, dim - i, 0);
+}
+
+#endif
+
+// Picks the kernel for CPU::level(). Only float distances and int64
+// distances between integers have kernels. getBounded() gives the bounded
+// kernels, except for IP.
+template <Metric metric, typename TV1, typename TV2, typename TResult>
+struct DistanceKernel {
+
+    typedef TResult (*kernel_t)(const TV1*, const TV2*, size_t, TResult);
+
+    static kernel_t get() {
+        return Distance<metric, TV1, TV2, TResult, false>;
+    }
+
+    static kernel_t getBounded() {
+        return Distance<metric, TV1, TV2, TResult, metric != IP>;
+    }
+
+};
+
+template <Metric metric, typename TV1, typename TV2>
+struct DistanceKernel<metric, TV1, TV2, float> {
+
+    typedef float (*kernel_t)(const TV1*, const TV2*, size_t, float);
+
+    static kernel_t get() {
+        return Select<false>();
+    }
+
+    static kernel_t getBounded() {
+        return Select<metric != IP>();
+    }
+
+private:
+    template <bool bounded>
+    static kernel_t Select() {
+#ifdef UTIL_SIMD_X86
+        switch (CPU::level()) {
+            case AVX512:
+                return DistanceAVX512<metric, TV1, TV2, bounded>;
+            case AVX2:
+                return DistanceAVX2<metric, TV1, TV2, bounded>;
+            default:
+                break;
+        }
+#endif
+        return DistanceScalar<metric, TV1, TV2, bounded>;
+    }
+
+};
+
+template <Metric metric, typename TV1, typename TV2>
+struct DistanceKernel<metric, TV1, TV2, int64_t> {
+
+    typedef int64_t (*kernel_t)(const TV1*, const TV2*, size_t, int64_t);
+
+    static kernel_t get() {
+        return Select<false>();
+    }
+
+    static kernel_t getBounded() {
+        return Select<metric != IP>();
+    }
+
+private:
+    template <bool bounded>
+    static kernel_t Select() {
+        return Select<bounded>(std::integral_constant<bool,
+                std::is_integral<TV1>::value &&
+                std::is_integral<TV2>::value>(),
+                std::integral_constant<bool,
+                sizeof(TV1) == 1 && sizeof(TV2) == 1>());
+    }
+
+    template <bool bounded, bool bytes>
+    static kernel_t Select(std::false_type, std::integral_constant<bool,
+            bytes>) {
+        return Distance<metric, TV1, TV2, int64_t, bounded>;
+    }
+
+    template <bool bounded>
+    static kernel_t Select(std::true_type, std::false_type) {
+#ifdef UTIL_SIMD_X86
+        switch (CPU::level()) {
+            case AVX512:
+                return DistanceQAVX512<metric, TV1, TV2, bounded>;
+            case AVX2:
+                return DistanceQAVX2<metric, TV1, TV2, bounded>;
+            default:
+                break;
+        }
+#endif
+        return Distance<metric, TV1, TV2, int64_t, bounded>;
+    }
+
+    template <bool bounded>
+    static kernel_t Select(std::true_type, std::true_type) {
+#ifdef UTIL_SIMD_X86
+        switch (CPU::level()) {
+            case AVX512:
+                return DistanceWAVX512<metric, TV1, TV2, bounded>;
+            case AVX2:
+                return DistanceWAVX2<metric, TV1, TV2, bounded>;
+            default:
+                break;
+        }
+#endif
+        return Distance<metric, TV1, TV2, int64_t, bounded>;
+    }
+
+};
+
+// Inner products for the GEMM engine of groundtruth. <panels> holds the
+// rows of a matrix in groups of UTIL_SIMD_PANEL, each group stored column
+// by column (so element j of column k of panel p is at
+// panels[(p * dim + k) * UTIL_SIMD_PANEL + j]), zero padded in the last
+// one. <products> receives <query_count> rows of
+// <panel_count> * UTIL_SIMD_PANEL inner products. Unlike Distance(), FMA
+// is used, so the results differ slightly between levels.
+inline void DotScalar(const float* queries, size_t query_count,
+        const float* panels, size_t panel_count, size_t dim,
+        float* products) {
+    for (size_t q = 0; q < query_count; q++) {
+        const float* query = queries + q * dim;
+        for (size_t p = 0; p < panel_count; p++) {
+            const float* panel = panels + p * dim * UTIL_SIMD_PANEL;
+            float* sums = products + (q * panel_count + p) * UTIL_SIMD_PANEL;
+            for (size_t j = 0; j < UTIL_SIMD_PANEL; j++) {
+                sums[j] = 0;
+            }
+            for (size_t k = 0; k < dim; k++) {
+                for (size_t j = 0; j < UTIL_SIMD_PANEL; j++) {
+                    sums[j] += query[k] * panel[k * UTIL_SIMD_PANEL + j];
+                }
+            }
+        }
+    }
+}
+
+#ifdef UTIL_SIMD_X86
+
+// <rows> queries against one panel, with all the sums in registers.
+template <size_t rows>
+UTIL_SIMD_AVX2_FMA
+inline void DotAVX2(const float* queries, const float* panel, size_t dim,
+        float* products, size_t stride) {
+    __m256 sums[rows][2];
+    for (size_t r = 0; r < rows; r++) {
+        sums[r][0] = _mm256_setzero_ps();
+        sums[r][1] = _mm256_setzero_ps();
+    }
+    for (size_t k = 0; k < dim; k++) {
+        __m256 column0 = _mm256_loadu_ps(panel + k * UTIL_SIMD_PANEL);
+        __m256 column1 = _mm256_loadu_ps(panel + k * UTIL_SIMD_PANEL + 8);
+        for (size_t r = 0; r < rows; r++) {
+            __m256 value = _mm256_broadcast_ss(queries + r * dim + k);
+            sums[r][0] = _mm256_fmadd_ps(value, column0, sums[r][0]);
+            sums[r][1] = _mm256_fmadd_ps(value, column1, sums[r][1]);
+        }
+    }
+    for (size_t r = 0; r < rows; r++) {
+        _mm256_storeu_ps(products + r * stride, sums[r][0]);
+        _mm256_storeu_ps(products + r * stride + 8, sums[r][1]);
+    }
+}
+
+UTIL_SIMD_AVX2_FMA
+inline void DotAVX2(const float* queries, size_t query_count,
+        const float* panels, size_t panel_count, size_t dim,
+        float* products) {
+    size_t stride = panel_count * UTIL_SIMD_PANEL;
+    size_t q = 0;
+    for (; q + 4 <= query_count; q += 4) {
+        for (size_t p = 0; p < panel_count; p++) {
+            DotAVX2<4>(queries + q * dim, panels + p * dim * UTIL_SIMD_PANEL,
+                    dim, products + q * stride + p * UTIL_SIMD_PANEL, stride);
+        }
+    }
+    for (; q < query_count; q++) {
+        for (size_t p = 0; p < panel_count; p++) {
+            DotAVX2<1>(queries + q * dim, panels + p * dim * UTIL_SIMD_PANEL,
+                    dim, products + q * stride + p * UTIL_SIMD_PANEL, stride);
+        }
+    }
+}
+
+template <size_t rows>
+UTIL_SIMD_AVX512_FMA
+inline void DotAVX512(const float* queries, const float* panel, size_t dim,
+        float* products, size_t stride) {
+    __m512 sums[rows];
+    for (size_t r = 0; r < rows; r++) {
+        sums[r] = _mm512_setzero_ps();
+    }
+    for (size_t k = 0; k < dim; k++) {
+        __m512 column = _mm512_loadu_ps(panel + k * UTIL_SIMD_PANEL);
+        for (size_t r = 0; r < rows; r++) {
+            sums[r] = _mm512_fmadd_ps(_mm512_set1_ps(queries[r * dim + k]),
+                    column, sums[r]);
+        }
+    }
+    for (size_t r = 0; r < rows; r++) {
+        _mm512_storeu_ps(products + r * stride, sums[r]);
+    }
+}
+
+UTIL_SIMD_AVX512_FMA
+inline void DotAVX512(const float* queries, size_t query_count,
+        const float* panels, size_t panel_count, size_t dim,
+        float* products) {
+    size_t stride = panel_count * UTIL_SIMD_PANEL;
+    size_t q = 0;
+    for (; q + 8 <= query_count; q += 8) {
+        for (size_t p = 0; p < panel_count; p++) {
+            DotAVX512<8>(queries + q * dim,
+                    panels + p * dim * UTIL_SIMD_PANEL, dim,
+                    products + q * stride + p * UTIL_SIMD_PANEL, stride);
+        }
+    }
+    for (; q < query_count; q++) {
+        for (size_t p = 0; p < panel_count; p++) {
+            DotAVX512<1>(queries + q * dim,
+                    panels + p * dim * UTIL_SIMD_PANEL, dim,
+                    products + q * stride + p * UTIL_SIMD_PANEL, stride);
+        }
+    }
+}
+
+#endif
+
+inline void Dot(const float* queries, size_t query_count,
+        const float* panels, size_t panel_count, size_t dim,
+        float* products) {
+    typedef void (*kernel_t)(const float*, size_t, const float*, size_t,
+            size_t, float*);
+#ifdef UTIL_SIMD_X86
+    static const kernel_t kernels[] = {DotScalar, DotAVX2, DotAVX512};
+#else
+    static const kernel_t kernels[] = {DotScalar, DotScalar, DotScalar};
+#endif
+    kernels[CPU::level()](queries, query_count, panels, panel_count, dim,
+            products);
+}
+
+// Inner products of unsigned and signed bytes, exact in int64, for the byte
+// L2 engine of groundtruth. vpdpbusd multiplies 4 times as many bytes per
+// instruction as the 16-bit products of DistanceWAVX2() and
+// DistanceWAVX512(). Each int32 lane gains at most 4 * 255 * 128 per
+// instruction, so it is widened every UTIL_SIMD_BLOCK instructions, long
+// before it could overflow.
+inline int64_t DotBytesScalar(const uint8_t* v1, const int8_t* v2,
+        size_t dim) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        sum += static_cast<int32_t>(v1[i]) * v2[i];
+    }
+    return sum;
+}
+
+#ifdef UTIL_SIMD_X86
+
+UTIL_SIMD_AVX2_VNNI
+inline int64_t DotBytesAVX2(const uint8_t* v1, const int8_t* v2,
+        size_t dim) {
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= dim) {
+        size_t end = std::min(dim, i + 32 * UTIL_SIMD_BLOCK);
+        __m256i block = _mm256_setzero_si256();
+        for (; i + 32 <= end; i += 32) {
+            block = _mm256_dpbusd_avx_epi32(block,
+                    _mm256_loadu_si256((const __m256i*)(v1 + i)),
+                    _mm256_loadu_si256((const __m256i*)(v2 + i)));
+        }
+        sum = WidenQ256(sum, block);
+    }
+    return ReduceQ256(sum) + DotBytesScalar(v1 + i, v2 + i, dim - i);
+}
+
+// The tail is loaded with a mask, as zeros beyond <dim>.
+UTIL_SIMD_AVX512_VNNI
+inline int64_t DotBytesAVX512(const uint8_t* v1, const int8_t* v2,
+        size_t dim) {
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    while (i < dim) {
+        size_t end = std::min(dim, i + 64 * UTIL_SIMD_BLOCK);
+        __m512i block = _mm512_setzero_si512();
+        for (; i + 64 <= end; i += 64) {
+            block = _mm512_dpbusd_epi32(block, _mm512_loadu_si512(v1 + i),
+                    _mm512_loadu_si512(v2 + i));
+        }
+        if (i < end) {
+            __mmask64 mask = ~0ULL >> (64 - (end - i));
+            block = _mm512_dpbusd_epi32(block,
+                    _mm512_maskz_loadu_epi8(mask, v1 + i),
+                    _mm512_maskz_loadu_epi8(mask, v2 + i));
+            i = end;
+        }
+        sum = _mm512_add_epi64(sum, _mm512_add_epi64(
+                _mm512_cvtepi32_epi64(_mm512_castsi512_si256(block)),
+                _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(block, 1))));
+    }
+    return ReduceQ512(sum);
+}
+
+#endif
+
+// Falls back to the scalar loop without CPU::vnni(), where the 16-bit
+// kernels of DistanceKernel are faster.
+struct DotBytesKernel {
+
+    typedef int64_t (*kernel_t)(const uint8_t*, const int8_t*, size_t);
+
+    static kernel_t get() {
+#ifdef UTIL_SIMD_X86
+        if (CPU::vnni()) {
+            return CPU::level() == AVX512 ? DotBytesAVX512 : DotBytesAVX2;
+        }
+#endif
+        return DotBytesScalar;
+    }
+
+};
+
+// Stores the indexes of the <values> that are at most <bound> into <hits>,
+// in order, and returns how many there are. For the top-k selection of
+// groundtruth, where most candidates fall beyond the bound.
+template <typename T>
+inline size_t FilterScalar(const T* values, size_t count, T bound,
+        uint32_t* hits) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        hits[n] = i;
+        n += values[i] <= bound;
+    }
+    return n;
+}
+
+#ifdef UTIL_SIMD_X86
+
+// Appends the set bits of <mask>, as indexes from <base>.
+inline size_t Scatter(uint32_t mask, size_t base, uint32_t* hits) {
+    size_t n = 0;
+    while (mask) {
+        hits[n++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return n;
+}
+
+UTIL_SIMD_AVX2
+inline size_t FilterAVX2(const float* values, size_t count, float bound,
+        uint32_t* hits) {
+    const __m256 bounds = _mm256_set1_ps(bound);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint32_t mask = _mm256_movemask_ps(_mm256_cmp_ps(
+                _mm256_loadu_ps(values + i), bounds, _CMP_LE_OQ));
+        n += Scatter(mask, i, hits + n);
+    }
+    for (; i < count; i++) {
+        hits[n] = i;
+        n += values[i] <= bound;
+    }
+    return n;
+}
+
+UTIL_SIMD_AVX2
+inline size_t FilterAVX2(const int64_t* values, size_t count, int64_t bound,
+        uint32_t* hits) {
+    const __m256i bounds = _mm256_set1_epi64x(bound);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i above = _mm256_cmpgt_epi64(
+                _mm256_loadu_si256((const __m256i*)(values + i)), bounds);
+        uint32_t mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(above)) & 0xf;
+        n += Scatter(mask, i, hits + n);
+    }
+    for (; i < count; i++) {
+        hits[n] = i;
+        n += values[i] <= bound;
+    }
+    return n;
+}
+
+UTIL_SIMD_AVX512
+inline size_t FilterAVX512(const float* values, size_t count, float bound,
+        uint32_t* hits) {
+    const __m512 bounds = _mm512_set1_ps(bound);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint32_t mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(values + i),
+                bounds, _CMP_LE_OQ);
+        n += Scatter(mask, i, hits + n);
+    }
+    for (; i < count; i++) {
+        hits[n] = i;
+        n += values[i] <= bound;
+    }
+    return n;
+}
+
+UTIL_SIMD_AVX512
+inline size_t FilterAVX512(const int64_t* values, size_t count,
+        int64_t bound, uint32_t* hits) {
+    const __m512i bounds = _mm512_set1_epi64(bound);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint32_t mask = _mm512_cmple_epi64_mask(
+                _mm512_loadu_si512(values + i), bounds);
+        n += Scatter(mask, i, hits + n);
+    }
+    for (; i < count; i++) {
+        hits[n] = i;
+        n += values[i] <= bound;
+    }
+    return n;
+}
+
+#endif
+
+// For float and int64 values.
+template <typename T>
+inline size_t Filter(const T* values, size_t count, T bound,
+        uint32_t* hits) {
+    typedef size_t (*kernel_t)(const T*, size_t, T, uint32_t*);
+#ifdef UTIL_SIMD_X86
+    static const kernel_t kernels[] = {
+        FilterScalar<T>,
+        FilterAVX2,
+        FilterAVX512,
+    };
+#else
+    static const kernel_t kernels[] = {
+        FilterScalar<T>,
+        FilterScalar<T>,
+        FilterScalar<T>,
+    };
+#endif
+    static const kernel_t kernel = kernels[CPU::level()];
+    return kernel(values, count, bound, hits);
+}
+
+}
+
+}
+
+#endif
@@ -1,16 +1,63 @@
 #ifndef UTIL_VECS_H
 #define UTIL_VECS_H
 
+#include <map>
+#include <deque>
+#include <mutex>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
+#include <algorithm>
 #include <stdexcept>
+#include <functional>
+#include <condition_variable>
 
 #include <zlib.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <dirent.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef DISABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifndef DISABLE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "vector.h"
+
+#define UTIL_VECS_CATALOG_MAGIC     "VECSIDX1"
+#define UTIL_VECS_CATALOG_SUFFIX    ".idx"
+#define UTIL_VECS_GZINDEX_MAGIC     "VECSGZI1"
+#define UTIL_VECS_GZINDEX_SUFFIX    ".gzi"
+#define UTIL_VECS_CACHE_ENV         "VECS_CACHE_DIR"
+#define UTIL_VECS_GZ_WINDOW         32768
+#define UTIL_VECS_GZ_FEED           (1UL << 30)
+#define UTIL_VECS_ZSTD_LEVEL        3
+#define UTIL_VECS_CHUNK             (1UL << 20)
+#define UTIL_VECS_SPAN_MAX          (256UL << 20)
+
+#ifndef UTIL_VECS_SPAN
+#define UTIL_VECS_SPAN              (4UL << 20)
+#endif
+
+#ifndef UTIL_VECS_THREADS
+#define UTIL_VECS_THREADS           8
+#endif
+
+#ifndef UTIL_VECS_READAHEAD_DEPTH
+#define UTIL_VECS_READAHEAD_DEPTH   2
+#endif
 
 namespace util {
 
@@ -31,6 +78,96 @@ public:
     virtual ssize_t seek(size_t position, int whence) = 0;
 
     virtual bool eof() = 0;
+
+    // Returns the next <len> bytes in place and moves past them, or nullptr
+    // if the file can't expose its content directly.
+    virtual const void* map(size_t len) {
+        return nullptr;
+    }
+
+    // Returns up to <count> vectors of <len> bytes in place as a dense
+    // matrix, without their dimension prefixes, and moves past them. <count>
+    // is lowered at the end of file. Returns nullptr if the file doesn't
+    // store vectors that way.
+    virtual const void* mapRows(size_t& count, size_t len) {
+        return nullptr;
+    }
+};
+
+class Sidecar {
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t source_size;
+        int64_t source_mtime_sec;
+        int64_t source_mtime_nsec;
+    };
+
+    FILE* file;
+    bool rw;
+    std::string fpath;
+    std::string tmp_fpath;
+
+public:
+    Sidecar() : file(nullptr) {}
+
+    ~Sidecar() {
+        if (file) {
+            fclose(file);
+            if (!rw) {
+                unlink(tmp_fpath.c_str());
+            }
+        }
+    }
+
+    // A sidecar caches data derived from its <source>, and is valid only as
+    // long as the source keeps its size and mtime. When writing, the content
+    // goes to a temporary file that commit() renames into place, so
+    // concurrent readers never see a partial sidecar.
+    bool open(const char* _fpath, const char* magic,
+            const struct stat& source, bool _rw) {
+        assert(!file);
+        rw = _rw;
+        fpath = _fpath;
+        Header header;
+        if (rw) {
+            file = fopen(_fpath, "rb");
+            return file && read(&header, sizeof(header)) &&
+                    memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+                    header.source_size == (uint64_t)source.st_size &&
+                    header.source_mtime_sec == source.st_mtim.tv_sec &&
+                    header.source_mtime_nsec == source.st_mtim.tv_nsec;
+        }
+        tmp_fpath = fpath;
+        tmp_fpath.append(".").append(std::to_string(getpid()));
+        file = fopen(tmp_fpath.c_str(), "wb");
+        memcpy(header.magic, magic, sizeof(header.magic));
+        header.source_size = source.st_size;
+        header.source_mtime_sec = source.st_mtim.tv_sec;
+        header.source_mtime_nsec = source.st_mtim.tv_nsec;
+        return file && write(&header, sizeof(header));
+    }
+
+    bool read(void* buf, size_t len) {
+        return fread(buf, 1, len, file) == len;
+    }
+
+    bool write(const void* buf, size_t len) {
+        return fwrite(buf, 1, len, file) == len;
+    }
+
+    bool commit() {
+        assert(file && !rw);
+        bool ok = fclose(file) == 0;
+        file = nullptr;
+        if (!ok || rename(tmp_fpath.c_str(), fpath.c_str()) != 0) {
+            unlink(tmp_fpath.c_str());
+            return false;
+        }
+        return true;
+    }
+
 };
 
 class PlainFile : public File {
@@ -80,160 +217,2238 @@ public:
 
 };
 
-class GzFile : public File {
+class MappedFile : public File {
 
 private:
-    gzFile file;
+    bool opened;
+    char* data;
+    size_t size;
+    size_t position;
 
 public:
-    GzFile() : file(nullptr) {}
+    MappedFile() : opened(false), data(nullptr), size(0), position(0) {}
 
-    ~GzFile() {
-        assert(!file);
+    ~MappedFile() {
+        assert(!opened);
     }
 
     void open(const char* fpath, bool rw) override {
-        assert(!file);
-        file = gzopen(fpath, rw ? "rb" : "wb");
-        if (!file) {
+        assert(!opened);
+        if (!rw) {
+            throw std::runtime_error("cannot map file for writing!");
+        }
+        int fd = ::open(fpath, O_RDONLY);
+        if (fd < 0) {
             throw std::runtime_error(std::string("cannot open file '")
                     .append(fpath).append("'!"));
         }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error(std::string("cannot stat file '")
+                    .append(fpath).append("'!"));
+        }
+        size = st.st_size;
+        data = nullptr;
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error(std::string("cannot map file '")
+                        .append(fpath).append("'!"));
+            }
+            madvise(addr, size, MADV_SEQUENTIAL);
+            data = (char*)addr;
+        }
+        ::close(fd);
+        position = 0;
+        opened = true;
     }
 
     void close() override {
-        int ret = gzclose(file);
-        if (ret) {
+        if (data && munmap(data, size) != 0) {
             throw std::runtime_error("cannot close file!");
         }
-        file = nullptr;
+        data = nullptr;
+        opened = false;
     }
 
     ssize_t read(void* buf, size_t len) override {
-        return gzread(file, buf, len);
+        size_t n = std::min(len, size - position);
+        memcpy(buf, data + position, n);
+        position += n;
+        return n;
     }
 
     ssize_t write(const void* buf, size_t len) override {
-        return gzwrite(file, buf, len);
+        return -1;
     }
 
     ssize_t seek(size_t position, int whence) override {
-        return gzseek(file, position, whence);
+        size_t base = 0;
+        if (whence == SEEK_CUR) {
+            base = this->position;
+        }
+        else if (whence == SEEK_END) {
+            base = size;
+        }
+        if (base + position > size) {
+            return -1;
+        }
+        this->position = base + position;
+        return 0;
     }
 
     bool eof() override {
-        return gzeof(file);
+        return position >= size;
+    }
+
+    const void* map(size_t len) override {
+        if (len > size - position) {
+            return nullptr;
+        }
+        const char* addr = data + position;
+        position += len;
+        return addr;
+    }
+
+    const unsigned char* getData() const {
+        return (const unsigned char*)data;
+    }
+
+    size_t getSize() const {
+        return size;
     }
 
 };
 
-template <typename T>
-class Formater {
+// Serves a stream that is split into spans which decode independently,
+// decoding the spans ahead of the reader with a pool of threads.
+class SpanReader {
+
+public:
+    typedef std::function<void(size_t, unsigned char*)> Decoder;
 
 private:
-    File* file;
+    std::vector<uint64_t> offsets;
+    Decoder decoder;
+    uint64_t position;
+    size_t current;
+    size_t scheduled;
+    size_t depth;
+    uint64_t generation;
+    bool stopping;
+    std::string error;
+    std::map<size_t, std::vector<unsigned char>> spans;
+    std::mutex mutex;
+    std::condition_variable produced;
+    std::condition_variable consumed;
+    std::vector<std::thread> workers;
 
 public:
-    Formater(File* _file) : file(_file) {}
-
-    std::vector<T> read() {
-        uint32_t dim;
-        std::vector<T> vector;
-        ssize_t ret = file->read(&dim, sizeof(dim));
-        if (ret == 0) {
-            assert(file->eof());
-            return vector;
+    // <offsets> holds where each span starts in the output, plus the total
+    // size at the end.
+    SpanReader(const std::vector<uint64_t>& _offsets, const Decoder& _decoder)
+            : offsets(_offsets), decoder(_decoder), position(0), current(0),
+            scheduled(0), generation(0), stopping(false) {
+        assert(offsets.size() >= 2);
+        size_t thread_count = std::min<size_t>(UTIL_VECS_THREADS,
+                std::max(2U, std::thread::hardware_concurrency()));
+        depth = thread_count * 2;
+        for (size_t i = 0; i < thread_count; i++) {
+            workers.emplace_back([this] {
+                work();
+            });
         }
-        if (ret != sizeof(dim)) {
-            throw std::runtime_error("broken file!");
+    }
+
+    ~SpanReader() {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        consumed.notify_all();
+        lock.unlock();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
         }
-        vector.resize(dim);
-        ret = file->read(vector.data(), sizeof(T) * dim);
-        if (ret != (ssize_t)sizeof(T) * dim) {
-            throw std::runtime_error("broken file!");
+    }
+
+    ssize_t read(void* buf, size_t len) {
+        size_t done = 0;
+        while (done < len && position < offsets.back()) {
+            const std::vector<unsigned char>& span = acquire();
+            size_t offset = position - offsets[current];
+            size_t n = std::min(len - done, span.size() - offset);
+            memcpy((char*)buf + done, span.data() + offset, n);
+            position += n;
+            done += n;
         }
-        return vector;
+        return done;
     }
 
-    bool skip() {
-        uint32_t dim;
-        ssize_t ret = file->read(&dim, sizeof(dim));
-        if (ret == 0) {
-            assert(file->eof());
-            return false;
+    ssize_t seek(size_t position, int whence) {
+        uint64_t base = 0;
+        if (whence == SEEK_CUR) {
+            base = this->position;
         }
-        if (ret != sizeof(dim)) {
-            throw std::runtime_error("broken file!");
+        else if (whence == SEEK_END) {
+            base = offsets.back();
         }
-        if (file->seek(sizeof(T) * dim, SEEK_CUR) < 0) {
-            throw std::runtime_error("broken file!");
+        if (base + position > offsets.back()) {
+            return -1;
         }
-        return true;
+        this->position = base + position;
+        return this->position;
     }
 
-    void reset() {
-        file->seek(0, SEEK_SET);
+    bool eof() const {
+        return position >= offsets.back();
     }
 
-    void write(const std::vector<T>& vector) {
-        uint32_t dim = vector.size();
-        ssize_t ret = file->write(&dim, sizeof(dim));
-        if (ret != sizeof(dim)) {
-            throw std::runtime_error("Output error!");
+    const void* map(size_t len) {
+        if (position >= offsets.back()) {
+            return nullptr;
         }
-        ret = file->write(vector.data(), sizeof(T) * dim);
-        if (ret != (ssize_t)sizeof(T) * dim) {
-            throw std::runtime_error("Output error!");
+        const std::vector<unsigned char>& span = acquire();
+        size_t offset = position - offsets[current];
+        if (len > span.size() - offset) {
+            return nullptr;
+        }
+        position += len;
+        return span.data() + offset;
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            consumed.wait(lock, [this] {
+                return stopping || (scheduled + 1 < offsets.size() &&
+                        scheduled < current + depth);
+            });
+            if (stopping) {
+                return;
+            }
+            size_t span = scheduled++;
+            uint64_t span_generation = generation;
+            lock.unlock();
+            std::vector<unsigned char> data(
+                    offsets[span + 1] - offsets[span]);
+            std::string span_error;
+            try {
+                decoder(span, data.data());
+            }
+            catch (const std::exception& e) {
+                span_error = e.what();
+            }
+            lock.lock();
+            if (span_generation == generation) {
+                if (!span_error.empty()) {
+                    error = span_error;
+                }
+                spans[span] = std::move(data);
+                produced.notify_all();
+            }
+        }
+    }
+
+    // Returns the span that contains <position>, waiting for it to be
+    // decoded. Spans behind it are released, and a jump outside of the
+    // spans in flight restarts decoding from the new one.
+    const std::vector<unsigned char>& acquire() {
+        size_t span = std::upper_bound(offsets.begin(), offsets.end() - 1,
+                position) - offsets.begin() - 1;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (span != current) {
+            if (span > current && span < scheduled) {
+                spans.erase(spans.begin(), spans.lower_bound(span));
+            }
+            else {
+                generation++;
+                spans.clear();
+                scheduled = span;
+            }
+            current = span;
+            consumed.notify_all();
         }
+        auto iter = spans.end();
+        produced.wait(lock, [&] {
+            iter = spans.find(span);
+            return iter != spans.end() || !error.empty();
+        });
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        return iter->second;
     }
 
 };
 
-class SuffixWrapper {
+// Base of the compressed input files. The compressed file is mapped, and
+// decoded in parallel by a SpanReader if the codec can split it into spans,
+// or else as one stream.
+class StreamFile : public File {
+
+protected:
+    MappedFile source;
+
 private:
-    File* file;
-    char type;
+    std::unique_ptr<SpanReader> spans;
+    std::vector<unsigned char> chunk;
+    size_t chunk_offset;
+    uint64_t position;
 
 public:
-    SuffixWrapper(const char* fpath, bool rw) {
-        std::string suffix(fpath);
-        bool is_gz = EndsWith(suffix, ".gz");
-        if (is_gz) {
-            suffix.resize(suffix.length() - 3);
+    void open(const char* fpath, bool rw) override {
+        if (!rw) {
+            throw std::runtime_error("cannot write a compressed file "
+                    "for reading!");
         }
-        if (EndsWith(suffix, ".bvecs")) {
-            type = 'b';
+        source.open(fpath, true);
+        try {
+            std::vector<uint64_t> offsets;
+            if (split(fpath, offsets)) {
+                spans.reset(new SpanReader(offsets,
+                        [this](size_t span, unsigned char* dst) {
+                    decode(span, dst);
+                }));
+            }
+            else {
+                restart();
+            }
         }
-        else if (EndsWith(suffix, ".ivecs")) {
-            type = 'i';
+        catch (...) {
+            source.close();
+            throw;
         }
-        else if (EndsWith(suffix, ".fvecs")) {
-            type = 'f';
+    }
+
+    void close() override {
+        spans.reset();
+        source.close();
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        if (spans) {
+            return spans->read(buf, len);
+        }
+        size_t done = 0;
+        while (done < len) {
+            if (chunk_offset == chunk.size() && !fill()) {
+                break;
+            }
+            size_t n = std::min(len - done, chunk.size() - chunk_offset);
+            memcpy((char*)buf + done, chunk.data() + chunk_offset, n);
+            chunk_offset += n;
+            position += n;
+            done += n;
+        }
+        return done;
+    }
+
+    ssize_t write(const void* buf, size_t len) override {
+        return -1;
+    }
+
+    // Without spans, seeking backwards decodes again from the beginning,
+    // and SEEK_END isn't supported.
+    ssize_t seek(size_t position, int whence) override {
+        if (spans) {
+            return spans->seek(position, whence);
+        }
+        uint64_t target;
+        if (whence == SEEK_SET) {
+            target = position;
+        }
+        else if (whence == SEEK_CUR) {
+            target = this->position + position;
         }
         else {
-            throw std::runtime_error(std::string("unsupported format '")
-                    .append(fpath).append("'!"));
+            return -1;
         }
-        file = is_gz ? (File*)(new GzFile) : (File*)(new PlainFile);
-        std::unique_ptr<File> file_deleter(file);
-        file->open(fpath, rw);
-        file_deleter.release();
+        if (target < this->position) {
+            restart();
+        }
+        while (this->position < target) {
+            if (chunk_offset == chunk.size() && !fill()) {
+                return -1;
+            }
+            size_t n = std::min<uint64_t>(target - this->position,
+                    chunk.size() - chunk_offset);
+            chunk_offset += n;
+            this->position += n;
+        }
+        return this->position;
     }
 
-    ~SuffixWrapper() {
-        file->close();
-        delete file;
+    bool eof() override {
+        if (spans) {
+            return spans->eof();
+        }
+        return chunk_offset == chunk.size() && !fill();
     }
 
-    File* getFile() const {
-        return file;
+    const void* map(size_t len) override {
+        return spans ? spans->map(len) : nullptr;
     }
 
-    char getDataType() const {
-        return type;
+protected:
+    // Fills <offsets> with where each span starts in the output, plus the
+    // total size at the end. Returns false if there aren't at least two
+    // spans, or if the file can't be split.
+    virtual bool split(const char* fpath, std::vector<uint64_t>& offsets) = 0;
+
+    virtual void decode(size_t span, unsigned char* dst) = 0;
+
+    virtual void rewind() = 0;
+
+    // Decodes the stream into <dst> and returns the length of the output,
+    // which is 0 only at the end of stream.
+    virtual size_t decompress(unsigned char* dst, size_t len) = 0;
+
+private:
+    void restart() {
+        rewind();
+        chunk.clear();
+        chunk_offset = 0;
+        position = 0;
+    }
+
+    bool fill() {
+        chunk.resize(UTIL_VECS_CHUNK);
+        chunk.resize(decompress(chunk.data(), chunk.size()));
+        chunk_offset = 0;
+        return !chunk.empty();
+    }
+
+};
+
+class GzIndex {
+
+private:
+    struct Header {
+        uint64_t total;
+        uint64_t count;
+    };
+
+    struct Point {
+        uint64_t out;
+        uint64_t in;
+        // Bits of the byte before <in> that belong to the next deflate
+        // block, or -1 if a gzip member starts at <in>.
+        int32_t bits;
+        std::vector<unsigned char> window;
+    };
+
+    uint64_t total;
+    std::vector<Point> points;
+
+public:
+    GzIndex() : total(0) {}
+
+    size_t size() const {
+        return points.size();
+    }
+
+    std::vector<uint64_t> getOffsets() const {
+        std::vector<uint64_t> offsets;
+        for (size_t i = 0; i < points.size(); i++) {
+            offsets.push_back(points[i].out);
+        }
+        offsets.push_back(total);
+        return offsets;
+    }
+
+    // One pass of inflate over the whole file, recording an access point
+    // (with the 32KB window needed to resume from it) every <span> bytes of
+    // output. Concatenated gzip members are supported, and a member start is
+    // an access point that needs no window.
+    void build(const unsigned char* data, size_t size, uint64_t span) {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit2(&strm, 31) != Z_OK) {
+            throw std::runtime_error("inflateInit2() failed!");
+        }
+        std::unique_ptr<unsigned char[]> window(
+                new unsigned char[UTIL_VECS_GZ_WINDOW]);
+        uint64_t totin = 0, totout = 0, last = 0;
+        size_t members = 0;
+        bool in_member = false;
+        points.clear();
+        addPoint(0, 0, -1, nullptr, 0);
+        try {
+            while (totin < size) {
+                strm.next_in = (unsigned char*)data + totin;
+                strm.avail_in = std::min<uint64_t>(size - totin,
+                        UTIL_VECS_GZ_FEED);
+                if (strm.avail_out == 0) {
+                    strm.next_out = window.get();
+                    strm.avail_out = UTIL_VECS_GZ_WINDOW;
+                }
+                totin += strm.avail_in;
+                totout += strm.avail_out;
+                int ret = inflate(&strm, Z_BLOCK);
+                totin -= strm.avail_in;
+                totout -= strm.avail_out;
+                if (ret == Z_DATA_ERROR && !in_member && members > 0) {
+                    // Trailing garbage after the last member, which is
+                    // ignored just like gzread() does.
+                    break;
+                }
+                if (ret != Z_OK && ret != Z_STREAM_END &&
+                        ret != Z_BUF_ERROR) {
+                    throw std::runtime_error("broken gzip file!");
+                }
+                if (ret == Z_STREAM_END) {
+                    inflateReset(&strm);
+                    members++;
+                    in_member = false;
+                    if (totout - last >= span) {
+                        addPoint(totout, totin, -1, nullptr, 0);
+                        last = totout;
+                    }
+                    continue;
+                }
+                in_member = true;
+                if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+                        totout - last >= span) {
+                    addPoint(totout, totin, strm.data_type & 7,
+                            window.get(), strm.avail_out);
+                    last = totout;
+                }
+            }
+        }
+        catch (...) {
+            inflateEnd(&strm);
+            throw;
+        }
+        inflateEnd(&strm);
+        if (in_member) {
+            throw std::runtime_error("broken gzip file!");
+        }
+        if (points.size() > 1 && points.back().out == totout) {
+            points.pop_back();
+        }
+        total = totout;
+    }
+
+    // Inflates the whole <span> into <dst>. It only reads <data>, so
+    // several threads may decode different spans at once.
+    void decode(const unsigned char* data, size_t size, size_t span,
+            unsigned char* dst) const {
+        const Point& point = points[span];
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        bool raw = point.bits >= 0;
+        if (inflateInit2(&strm, raw ? -15 : 31) != Z_OK) {
+            throw std::runtime_error("inflateInit2() failed!");
+        }
+        if (raw && point.bits > 0) {
+            inflatePrime(&strm, point.bits,
+                    data[point.in - 1] >> (8 - point.bits));
+        }
+        if (raw) {
+            inflateSetDictionary(&strm, point.window.data(),
+                    point.window.size());
+        }
+        uint64_t in = point.in;
+        strm.next_out = dst;
+        strm.avail_out = (span + 1 < points.size() ?
+                points[span + 1].out : total) - point.out;
+        size_t trailer = 0;
+        int ret = Z_OK;
+        while (strm.avail_out != 0 && in < size) {
+            strm.next_in = (unsigned char*)data + in;
+            strm.avail_in = std::min<uint64_t>(size - in, UTIL_VECS_GZ_FEED);
+            if (trailer) {
+                // A raw stream leaves the gzip trailer of its member behind.
+                size_t n = std::min<size_t>(trailer, strm.avail_in);
+                in += n;
+                trailer -= n;
+                if (trailer == 0) {
+                    inflateReset2(&strm, 31);
+                    raw = false;
+                }
+                continue;
+            }
+            in += strm.avail_in;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            in -= strm.avail_in;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                break;
+            }
+            if (ret == Z_STREAM_END) {
+                if (raw) {
+                    trailer = 8;
+                }
+                else {
+                    inflateReset(&strm);
+                }
+            }
+        }
+        inflateEnd(&strm);
+        if (strm.avail_out != 0) {
+            throw std::runtime_error("broken gzip file!");
+        }
+    }
+
+    bool load(const char* fpath, const struct stat& source) {
+        Sidecar sidecar;
+        Header header;
+        if (!sidecar.open(fpath, UTIL_VECS_GZINDEX_MAGIC, source, true) ||
+                !sidecar.read(&header, sizeof(header))) {
+            return false;
+        }
+        total = header.total;
+        points.resize(header.count);
+        for (size_t i = 0; i < points.size(); i++) {
+            Point& point = points[i];
+            uint32_t window_size;
+            if (!sidecar.read(&point.out, sizeof(point.out)) ||
+                    !sidecar.read(&point.in, sizeof(point.in)) ||
+                    !sidecar.read(&point.bits, sizeof(point.bits)) ||
+                    !sidecar.read(&window_size, sizeof(window_size))) {
+                return false;
+            }
+            point.window.resize(window_size);
+            if (!sidecar.read(point.window.data(), window_size)) {
+                return false;
+            }
+        }
+        return !points.empty();
+    }
+
+    // Best effort, like Catalog::save().
+    void save(const char* fpath, const struct stat& source) const {
+        Sidecar sidecar;
+        Header header;
+        header.total = total;
+        header.count = points.size();
+        if (!sidecar.open(fpath, UTIL_VECS_GZINDEX_MAGIC, source, false) ||
+                !sidecar.write(&header, sizeof(header))) {
+            return;
+        }
+        for (size_t i = 0; i < points.size(); i++) {
+            const Point& point = points[i];
+            uint32_t window_size = point.window.size();
+            if (!sidecar.write(&point.out, sizeof(point.out)) ||
+                    !sidecar.write(&point.in, sizeof(point.in)) ||
+                    !sidecar.write(&point.bits, sizeof(point.bits)) ||
+                    !sidecar.write(&window_size, sizeof(window_size)) ||
+                    !sidecar.write(point.window.data(), window_size)) {
+                return;
+            }
+        }
+        sidecar.commit();
+    }
+
+    // For writers that compress each span as an independent gzip member,
+    // where every member start is an access point.
+    void addMember(uint64_t out, uint64_t in, uint64_t len) {
+        if (points.empty()) {
+            addPoint(0, 0, -1, nullptr, 0);
+        }
+        if (out > 0 && len > 0) {
+            addPoint(out, in, -1, nullptr, 0);
+        }
+        total = out + len;
+    }
+
+private:
+    void addPoint(uint64_t out, uint64_t in, int bits,
+            const unsigned char* window, size_t left) {
+        points.emplace_back();
+        Point& point = points.back();
+        point.out = out;
+        point.in = in;
+        point.bits = bits;
+        if (window) {
+            // <window> is circular, and the next output byte would go to
+            // <end>, so the newest <size> bytes end right before it.
+            size_t size = std::min<uint64_t>(out, UTIL_VECS_GZ_WINDOW);
+            size_t end = UTIL_VECS_GZ_WINDOW - left;
+            point.window.resize(size);
+            if (end >= size) {
+                memcpy(point.window.data(), window + end - size, size);
+            }
+            else {
+                memcpy(point.window.data(),
+                        window + UTIL_VECS_GZ_WINDOW - (size - end),
+                        size - end);
+                memcpy(point.window.data() + size - end, window, end);
+            }
+        }
+    }
+
+};
+
+// The access-point index is loaded from (or built into) the "<fpath>.gzi"
+// sidecar, so that spans of UTIL_VECS_SPAN bytes can be inflated in
+// parallel.
+class GzFile : public StreamFile {
+
+private:
+    GzIndex index;
+    z_stream strm;
+    bool inflating;
+    uint64_t in;
+    size_t members;
+    bool in_member;
+
+public:
+    GzFile() : inflating(false) {}
+
+    ~GzFile() {
+        if (inflating) {
+            inflateEnd(&strm);
+        }
+    }
+
+protected:
+    bool split(const char* fpath, std::vector<uint64_t>& offsets) override {
+        struct stat st;
+        if (stat(fpath, &st) != 0) {
+            return false;
+        }
+        std::string gzi_fpath(fpath);
+        gzi_fpath.append(UTIL_VECS_GZINDEX_SUFFIX);
+        if (!index.load(gzi_fpath.c_str(), st)) {
+            index.build(source.getData(), source.getSize(), UTIL_VECS_SPAN);
+            index.save(gzi_fpath.c_str(), st);
+        }
+        offsets = index.getOffsets();
+        return index.size() >= 2;
+    }
+
+    void decode(size_t span, unsigned char* dst) override {
+        index.decode(source.getData(), source.getSize(), span, dst);
+    }
+
+    void rewind() override {
+        if (inflating) {
+            inflateEnd(&strm);
+        }
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit2(&strm, 31) != Z_OK) {
+            throw std::runtime_error("inflateInit2() failed!");
+        }
+        inflating = true;
+        in = 0;
+        members = 0;
+        in_member = false;
+    }
+
+    size_t decompress(unsigned char* dst, size_t len) override {
+        const unsigned char* data = source.getData();
+        size_t size = source.getSize();
+        strm.next_out = dst;
+        strm.avail_out = len;
+        while (strm.avail_out == len && in < size) {
+            strm.next_in = (unsigned char*)data + in;
+            strm.avail_in = std::min<uint64_t>(size - in, UTIL_VECS_GZ_FEED);
+            in += strm.avail_in;
+            int ret = inflate(&strm, Z_NO_FLUSH);
+            in -= strm.avail_in;
+            if (ret == Z_DATA_ERROR && !in_member && members > 0) {
+                in = size;
+                break;
+            }
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw std::runtime_error("broken gzip file!");
+            }
+            if (ret == Z_STREAM_END) {
+                inflateReset(&strm);
+                members++;
+                in_member = false;
+            }
+            else {
+                in_member = true;
+            }
+        }
+        if (strm.avail_out == len && in_member) {
+            throw std::runtime_error("broken gzip file!");
+        }
+        return len - strm.avail_out;
+    }
+
+};
+
+#ifndef DISABLE_ZSTD
+
+// Files written by BlockZstdFile, or any other file made of several frames
+// that record their content sizes, are decoded frame by frame in parallel.
+class ZstdFile : public StreamFile {
+
+private:
+    std::vector<size_t> frames;
+    std::vector<size_t> frame_sizes;
+    ZSTD_DStream* dstream;
+    ZSTD_inBuffer input;
+    size_t last_ret;
+
+public:
+    ZstdFile() : dstream(nullptr) {}
+
+    ~ZstdFile() {
+        ZSTD_freeDStream(dstream);
+    }
+
+protected:
+    bool split(const char* fpath, std::vector<uint64_t>& offsets) override {
+        const unsigned char* data = source.getData();
+        size_t size = source.getSize();
+        offsets.assign(1, 0);
+        frames.clear();
+        frame_sizes.clear();
+        for (size_t pos = 0; pos < size; ) {
+            size_t frame_size = ZSTD_findFrameCompressedSize(data + pos,
+                    size - pos);
+            if (ZSTD_isError(frame_size)) {
+                throw std::runtime_error("broken zstd file!");
+            }
+            unsigned long long content = ZSTD_getFrameContentSize(
+                    data + pos, size - pos);
+            if (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+                    content == ZSTD_CONTENTSIZE_ERROR ||
+                    content > UTIL_VECS_SPAN_MAX) {
+                return false;
+            }
+            if (content > 0) {
+                frames.push_back(pos);
+                frame_sizes.push_back(frame_size);
+                offsets.push_back(offsets.back() + content);
+            }
+            pos += frame_size;
+        }
+        return frames.size() >= 2;
     }
 
+    void decode(size_t span, unsigned char* dst) override {
+        size_t len = ZSTD_getFrameContentSize(source.getData() + frames[span],
+                frame_sizes[span]);
+        size_t ret = ZSTD_decompress(dst, len,
+                source.getData() + frames[span], frame_sizes[span]);
+        if (ZSTD_isError(ret) || ret != len) {
+            throw std::runtime_error("broken zstd file!");
+        }
+    }
+
+    void rewind() override {
+        if (!dstream) {
+            dstream = ZSTD_createDStream();
+            if (!dstream) {
+                throw std::runtime_error("ZSTD_createDStream() failed!");
+            }
+        }
+        ZSTD_DCtx_reset(dstream, ZSTD_reset_session_only);
+        input.src = source.getData();
+        input.size = source.getSize();
+        input.pos = 0;
+        last_ret = 0;
+    }
+
+    size_t decompress(unsigned char* dst, size_t len) override {
+        ZSTD_outBuffer output = {dst, len, 0};
+        while (output.pos == 0 && input.pos < input.size) {
+            last_ret = ZSTD_decompressStream(dstream, &output, &input);
+            if (ZSTD_isError(last_ret)) {
+                throw std::runtime_error("broken zstd file!");
+            }
+        }
+        if (output.pos == 0 && last_ret != 0) {
+            last_ret = ZSTD_decompressStream(dstream, &output, &input);
+            if (ZSTD_isError(last_ret) || (output.pos == 0 && last_ret)) {
+                throw std::runtime_error("broken zstd file!");
+            }
+        }
+        return output.pos;
+    }
+
+};
+
+#endif
+
+#ifndef DISABLE_LZ4
+
+// Like ZstdFile, frames that record their content sizes are decoded in
+// parallel.
+class Lz4File : public StreamFile {
+
 private:
+    std::vector<size_t> frames;
+    std::vector<size_t> frame_sizes;
+    LZ4F_dctx* dctx;
+    size_t in;
+    size_t last_ret;
+
+public:
+    Lz4File() : dctx(nullptr) {}
+
+    ~Lz4File() {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+
+protected:
+    bool split(const char* fpath, std::vector<uint64_t>& offsets) override {
+        const unsigned char* data = source.getData();
+        size_t size = source.getSize();
+        offsets.assign(1, 0);
+        frames.clear();
+        frame_sizes.clear();
+        for (size_t pos = 0; pos < size; ) {
+            uint64_t content;
+            size_t frame_size = ScanFrame(data + pos, size - pos, content);
+            if (content == (uint64_t)-1 || content > UTIL_VECS_SPAN_MAX) {
+                return false;
+            }
+            if (content > 0) {
+                frames.push_back(pos);
+                frame_sizes.push_back(frame_size);
+                offsets.push_back(offsets.back() + content);
+            }
+            pos += frame_size;
+        }
+        return frames.size() >= 2;
+    }
+
+    void decode(size_t span, unsigned char* dst) override {
+        LZ4F_dctx* span_dctx;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&span_dctx,
+                LZ4F_VERSION))) {
+            throw std::runtime_error("LZ4F_createDecompressionContext() "
+                    "failed!");
+        }
+        const unsigned char* src = source.getData() + frames[span];
+        size_t src_left = frame_sizes[span];
+        uint64_t content;
+        ScanFrame(src, src_left, content);
+        size_t dst_left = content;
+        size_t ret = 1;
+        while (ret != 0 && src_left > 0) {
+            size_t src_size = src_left;
+            size_t dst_size = dst_left;
+            ret = LZ4F_decompress(span_dctx, dst, &dst_size, src, &src_size,
+                    nullptr);
+            if (LZ4F_isError(ret)) {
+                break;
+            }
+            src += src_size;
+            src_left -= src_size;
+            dst += dst_size;
+            dst_left -= dst_size;
+        }
+        LZ4F_freeDecompressionContext(span_dctx);
+        if (ret != 0 || dst_left != 0) {
+            throw std::runtime_error("broken lz4 file!");
+        }
+    }
+
+    void rewind() override {
+        if (!dctx && LZ4F_isError(LZ4F_createDecompressionContext(&dctx,
+                LZ4F_VERSION))) {
+            throw std::runtime_error("LZ4F_createDecompressionContext() "
+                    "failed!");
+        }
+        LZ4F_resetDecompressionContext(dctx);
+        in = 0;
+        last_ret = 0;
+    }
+
+    size_t decompress(unsigned char* dst, size_t len) override {
+        const unsigned char* data = source.getData();
+        size_t size = source.getSize();
+        size_t done = 0;
+        while (done == 0 && in < size) {
+            size_t src_size = size - in;
+            size_t dst_size = len;
+            last_ret = LZ4F_decompress(dctx, dst, &dst_size, data + in,
+                    &src_size, nullptr);
+            if (LZ4F_isError(last_ret)) {
+                throw std::runtime_error("broken lz4 file!");
+            }
+            in += src_size;
+            done = dst_size;
+        }
+        if (done == 0 && last_ret != 0) {
+            throw std::runtime_error("broken lz4 file!");
+        }
+        return done;
+    }
+
+private:
+    // Walks the block headers of the frame at <data>, and returns its
+    // compressed size. <content> is set to (uint64_t)-1 if the frame doesn't
+    // record its content size, and to 0 for skippable frames.
+    static size_t ScanFrame(const unsigned char* data, size_t size,
+            uint64_t& content) {
+        uint32_t magic;
+        if (size < 8) {
+            throw std::runtime_error("broken lz4 file!");
+        }
+        memcpy(&magic, data, sizeof(magic));
+        if ((magic & 0xFFFFFFF0U) == LZ4F_MAGIC_SKIPPABLE_START) {
+            uint32_t skip;
+            memcpy(&skip, data + 4, sizeof(skip));
+            content = 0;
+            return 8 + skip;
+        }
+        if (magic != LZ4F_MAGICNUMBER) {
+            throw std::runtime_error("broken lz4 file!");
+        }
+        unsigned char flg = data[4];
+        bool block_checksum = flg & 0x10;
+        bool has_content_size = flg & 0x08;
+        bool content_checksum = flg & 0x04;
+        bool has_dict_id = flg & 0x01;
+        size_t pos = 6;
+        content = (uint64_t)-1;
+        if (has_content_size) {
+            if (size < pos + 8) {
+                throw std::runtime_error("broken lz4 file!");
+            }
+            memcpy(&content, data + pos, sizeof(content));
+            pos += 8;
+        }
+        pos += (has_dict_id ? 4 : 0) + 1;
+        while (true) {
+            uint32_t block_size;
+            if (size < pos + 4) {
+                throw std::runtime_error("broken lz4 file!");
+            }
+            memcpy(&block_size, data + pos, sizeof(block_size));
+            pos += 4;
+            if (block_size == 0) {
+                break;
+            }
+            pos += (block_size & 0x7FFFFFFFU) + (block_checksum ? 4 : 0);
+        }
+        pos += content_checksum ? 4 : 0;
+        if (pos > size) {
+            throw std::runtime_error("broken lz4 file!");
+        }
+        return pos;
+    }
+
+};
+
+#endif
+
+// Base of the compressed output files. The output is cut into blocks of
+// UTIL_VECS_SPAN bytes, each compressed independently by a pool of threads
+// while the caller keeps filling the next block, and written in order by
+// another thread. The caller blocks only when every block is in flight.
+class BlockFile : public File {
+
+private:
+    struct Block {
+        size_t seq;
+        std::vector<unsigned char> data;
+        std::vector<unsigned char> compressed;
+    };
+
+    int fd;
+    std::string path;
+    size_t depth;
+    size_t block_count;
+    size_t submitted;
+    size_t written;
+    uint64_t out;
+    uint64_t in;
+    bool stopping;
+    std::string error;
+    Block* filling;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::vector<Block*> free_blocks;
+    std::deque<Block*> pending;
+    std::map<size_t, Block*> compressed;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> workers;
+    std::thread writer;
+
+public:
+    BlockFile() : fd(-1) {}
+
+    ~BlockFile() {
+        assert(fd < 0);
+    }
+
+    void open(const char* fpath, bool rw) override {
+        assert(fd < 0);
+        if (rw) {
+            throw std::runtime_error("cannot read a compressed file "
+                    "for writing!");
+        }
+        fd = ::open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("'!"));
+        }
+        path = fpath;
+        size_t thread_count = std::min<size_t>(UTIL_VECS_THREADS,
+                std::max(1U, std::thread::hardware_concurrency()));
+        depth = thread_count * 2 + 1;
+        block_count = 0;
+        submitted = 0;
+        written = 0;
+        out = 0;
+        in = 0;
+        stopping = false;
+        error.clear();
+        filling = newBlock();
+        for (size_t i = 0; i < thread_count; i++) {
+            workers.emplace_back([this] {
+                work();
+            });
+        }
+        writer = std::thread([this] {
+            flush();
+        });
+    }
+
+    void close() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!filling->data.empty() || submitted == 0) {
+            submit(filling);
+        }
+        filling = nullptr;
+        stopping = true;
+        changed.notify_all();
+        lock.unlock();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+        workers.clear();
+        writer.join();
+        blocks.clear();
+        free_blocks.clear();
+        int ret = ::close(fd);
+        fd = -1;
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        if (ret) {
+            throw std::runtime_error("cannot close file!");
+        }
+        finish(path.c_str());
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        return -1;
+    }
+
+    ssize_t write(const void* buf, size_t len) override {
+        const unsigned char* src = (const unsigned char*)buf;
+        size_t left = len;
+        while (left) {
+            size_t n = std::min(left,
+                    UTIL_VECS_SPAN - filling->data.size());
+            filling->data.insert(filling->data.end(), src, src + n);
+            src += n;
+            left -= n;
+            if (filling->data.size() == UTIL_VECS_SPAN) {
+                std::unique_lock<std::mutex> lock(mutex);
+                submit(filling);
+                changed.wait(lock, [this] {
+                    return !free_blocks.empty() || block_count < depth;
+                });
+                if (free_blocks.empty()) {
+                    filling = newBlock();
+                }
+                else {
+                    filling = free_blocks.back();
+                    free_blocks.pop_back();
+                }
+                if (!error.empty()) {
+                    return -1;
+                }
+            }
+        }
+        return len;
+    }
+
+    ssize_t seek(size_t position, int whence) override {
+        return -1;
+    }
+
+    bool eof() override {
+        return false;
+    }
+
+protected:
+    // Called concurrently from the worker threads.
+    virtual void compress(const std::vector<unsigned char>& data,
+            std::vector<unsigned char>& compressed) = 0;
+
+    // Called in order, from the writer thread, once a block is written.
+    virtual void flushed(uint64_t out, uint64_t in, size_t len) {}
+
+    // Called after the file is completely written and closed.
+    virtual void finish(const char* fpath) {}
+
+private:
+    Block* newBlock() {
+        blocks.emplace_back(new Block);
+        block_count++;
+        Block* block = blocks.back().get();
+        block->data.reserve(UTIL_VECS_SPAN);
+        return block;
+    }
+
+    void submit(Block* block) {
+        block->seq = submitted++;
+        pending.push_back(block);
+        changed.notify_all();
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] {
+                return stopping || !pending.empty();
+            });
+            if (pending.empty()) {
+                return;
+            }
+            Block* block = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            std::string block_error;
+            try {
+                compress(block->data, block->compressed);
+            }
+            catch (const std::exception& e) {
+                block_error = e.what();
+            }
+            lock.lock();
+            if (!block_error.empty()) {
+                error = block_error;
+            }
+            compressed[block->seq] = block;
+            changed.notify_all();
+        }
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            auto iter = compressed.end();
+            changed.wait(lock, [&] {
+                iter = compressed.find(written);
+                return iter != compressed.end() ||
+                        (stopping && written == submitted);
+            });
+            if (iter == compressed.end()) {
+                return;
+            }
+            Block* block = iter->second;
+            compressed.erase(iter);
+            bool ok = error.empty();
+            lock.unlock();
+            const unsigned char* data = block->compressed.data();
+            size_t left = block->compressed.size();
+            while (ok && left) {
+                ssize_t n = ::write(fd, data, left);
+                if (n <= 0) {
+                    ok = false;
+                    break;
+                }
+                data += n;
+                left -= n;
+            }
+            if (ok) {
+                flushed(out, in, block->data.size());
+            }
+            lock.lock();
+            if (!ok && error.empty()) {
+                error = "Output error!";
+            }
+            out += block->data.size();
+            in += block->compressed.size();
+            written++;
+            block->data.clear();
+            free_blocks.push_back(block);
+            changed.notify_all();
+        }
+    }
+
+};
+
+// Every block is a gzip member, so the output is a regular .gz file for any
+// zlib reader, and its ".gzi" access-point index comes for free.
+class BlockGzFile : public BlockFile {
+
+private:
+    GzIndex index;
+
+protected:
+    void compress(const std::vector<unsigned char>& data,
+            std::vector<unsigned char>& compressed) override {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("deflateInit2() failed!");
+        }
+        compressed.resize(deflateBound(&strm, data.size()));
+        strm.next_in = (unsigned char*)data.data();
+        strm.avail_in = data.size();
+        strm.next_out = compressed.data();
+        strm.avail_out = compressed.size();
+        int ret = deflate(&strm, Z_FINISH);
+        compressed.resize(strm.total_out);
+        deflateEnd(&strm);
+        if (ret != Z_STREAM_END) {
+            throw std::runtime_error("deflate() failed!");
+        }
+    }
+
+    void flushed(uint64_t out, uint64_t in, size_t len) override {
+        index.addMember(out, in, len);
+    }
+
+    void finish(const char* fpath) override {
+        struct stat st;
+        if (stat(fpath, &st) == 0) {
+            std::string gzi_fpath(fpath);
+            gzi_fpath.append(UTIL_VECS_GZINDEX_SUFFIX);
+            index.save(gzi_fpath.c_str(), st);
+        }
+    }
+
+};
+
+#ifndef DISABLE_ZSTD
+
+// Every block is a zstd frame that records its content size, which is what
+// lets ZstdFile decode them in parallel.
+class BlockZstdFile : public BlockFile {
+
+protected:
+    void compress(const std::vector<unsigned char>& data,
+            std::vector<unsigned char>& compressed) override {
+        compressed.resize(ZSTD_compressBound(data.size()));
+        size_t ret = ZSTD_compress(compressed.data(), compressed.size(),
+                data.data(), data.size(), UTIL_VECS_ZSTD_LEVEL);
+        if (ZSTD_isError(ret)) {
+            throw std::runtime_error("ZSTD_compress() failed!");
+        }
+        compressed.resize(ret);
+    }
+
+};
+
+#endif
+
+#ifndef DISABLE_LZ4
+
+// Every block is an lz4 frame that records its content size.
+class BlockLz4File : public BlockFile {
+
+protected:
+    void compress(const std::vector<unsigned char>& data,
+            std::vector<unsigned char>& compressed) override {
+        LZ4F_preferences_t preferences;
+        memset(&preferences, 0, sizeof(preferences));
+        preferences.frameInfo.blockSizeID = LZ4F_max4MB;
+        preferences.frameInfo.contentSize = data.size();
+        compressed.resize(LZ4F_compressFrameBound(data.size(), &preferences));
+        size_t ret = LZ4F_compressFrame(compressed.data(), compressed.size(),
+                data.data(), data.size(), &preferences);
+        if (LZ4F_isError(ret)) {
+            throw std::runtime_error("LZ4F_compressFrame() failed!");
+        }
+        compressed.resize(ret);
+    }
+
+};
+
+#endif
+
+// The header-prefixed formats of the billion-scale benchmarks (.fbin,
+// .u8bin, .i8bin and .ibin): "uint32 n, uint32 d" followed by a dense n x d
+// matrix. It is presented as a regular vecs stream whose dimension prefixes
+// are synthesized, so Formater and Catalog work unchanged, while mapRows()
+// exposes the matrix itself.
+class BinFile : public File {
+
+private:
+    struct Header {
+        uint32_t count;
+        uint32_t dim;
+    };
+
+    std::unique_ptr<File> file;
+    size_t elem_size;
+    bool rw;
+    Header header;
+    uint64_t position;
+    uint32_t prefix;
+    size_t prefix_size;
+    uint64_t data_left;
+
+public:
+    BinFile(File* _file, size_t _elem_size) :
+            file(_file), elem_size(_elem_size) {}
+
+    void open(const char* fpath, bool rw) override {
+        file->open(fpath, rw);
+        this->rw = rw;
+        position = 0;
+        prefix_size = 0;
+        data_left = 0;
+        memset(&header, 0, sizeof(header));
+        ssize_t ret = rw ? file->read(&header, sizeof(header)) :
+                file->write(&header, sizeof(header));
+        if (ret != sizeof(header)) {
+            file->close();
+            throw std::runtime_error(rw ? "broken file!" : "Output error!");
+        }
+    }
+
+    // The header is written last, since <n> is unknown until then.
+    void close() override {
+        if (rw) {
+            file->close();
+            return;
+        }
+        bool ok = prefix_size == 0 && data_left == 0 &&
+                file->seek(0, SEEK_SET) == 0 &&
+                file->write(&header, sizeof(header)) == sizeof(header);
+        file->close();
+        if (!ok) {
+            throw std::runtime_error("cannot close file!");
+        }
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        uint64_t record_size = recordSize();
+        uint64_t total = header.count * record_size;
+        size_t done = 0;
+        while (done < len && position < total) {
+            size_t offset = position % record_size;
+            size_t n;
+            if (offset < sizeof(header.dim)) {
+                n = std::min(len - done, sizeof(header.dim) - offset);
+                memcpy((char*)buf + done, (char*)&header.dim + offset, n);
+            }
+            else {
+                ssize_t ret = file->read((char*)buf + done,
+                        std::min<uint64_t>(len - done, record_size - offset));
+                if (ret <= 0) {
+                    break;
+                }
+                n = ret;
+            }
+            position += n;
+            done += n;
+        }
+        return done;
+    }
+
+    // Strips the dimension prefixes, which must all be the same.
+    ssize_t write(const void* buf, size_t len) override {
+        const char* src = (const char*)buf;
+        size_t left = len;
+        while (left) {
+            if (data_left) {
+                size_t n = std::min<uint64_t>(left, data_left);
+                if (file->write(src, n) != (ssize_t)n) {
+                    return -1;
+                }
+                src += n;
+                left -= n;
+                data_left -= n;
+                continue;
+            }
+            size_t n = std::min(left, sizeof(prefix) - prefix_size);
+            memcpy((char*)&prefix + prefix_size, src, n);
+            src += n;
+            left -= n;
+            prefix_size += n;
+            if (prefix_size < sizeof(prefix)) {
+                break;
+            }
+            prefix_size = 0;
+            if (header.count == 0) {
+                header.dim = prefix;
+            }
+            else if (prefix != header.dim) {
+                // The vectors before it still make a valid file.
+                char buf[256];
+                sprintf(buf, "expect %uD vectors, but this vector is %uD!",
+                        header.dim, prefix);
+                throw std::runtime_error(buf);
+            }
+            if (header.count == UINT32_MAX) {
+                throw std::runtime_error("too many vectors for a .bin file!");
+            }
+            header.count++;
+            data_left = elem_size * header.dim;
+        }
+        return len;
+    }
+
+    ssize_t seek(size_t position, int whence) override {
+        uint64_t record_size = recordSize();
+        uint64_t total = header.count * record_size;
+        uint64_t base = 0;
+        if (whence == SEEK_CUR) {
+            base = this->position;
+        }
+        else if (whence == SEEK_END) {
+            base = total;
+        }
+        uint64_t target = base + position;
+        if (target > total) {
+            return -1;
+        }
+        size_t offset = std::max<uint64_t>(target % record_size,
+                sizeof(header.dim)) - sizeof(header.dim);
+        uint64_t data_offset = sizeof(header) +
+                target / record_size * (record_size - sizeof(header.dim)) +
+                offset;
+        if (file->seek(data_offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        this->position = target;
+        return 0;
+    }
+
+    bool eof() override {
+        return position >= header.count * recordSize();
+    }
+
+    const void* map(size_t len) override {
+        uint64_t record_size = recordSize();
+        size_t offset = position % record_size;
+        if (position >= header.count * record_size) {
+            return nullptr;
+        }
+        if (offset == 0 && len == sizeof(header.dim)) {
+            position += len;
+            return &header.dim;
+        }
+        if (offset < sizeof(header.dim) || len > record_size - offset) {
+            return nullptr;
+        }
+        const void* data = file->map(len);
+        if (data) {
+            position += len;
+        }
+        return data;
+    }
+
+    const void* mapRows(size_t& count, size_t len) override {
+        uint64_t record_size = recordSize();
+        uint64_t total = header.count * record_size;
+        if (position % record_size != 0 ||
+                len != record_size - sizeof(header.dim)) {
+            return nullptr;
+        }
+        count = std::min<uint64_t>(count, (total - position) / record_size);
+        if (count == 0) {
+            // Any valid pointer for an empty matrix.
+            return &header;
+        }
+        const void* data = file->map(count * len);
+        if (data) {
+            position += count * record_size;
+        }
+        return data;
+    }
+
+    size_t getCount() const {
+        return header.count;
+    }
+
+    size_t getDim() const {
+        return header.dim;
+    }
+
+private:
+    uint64_t recordSize() const {
+        return sizeof(header.dim) + elem_size * header.dim;
+    }
+
+};
+
+// An opt-in cache of decoded inputs, enabled by naming a directory in the
+// UTIL_VECS_CACHE_ENV environment variable. An input is copied there once,
+// as a dense .bin matrix of its own element type, and later opens map that
+// copy instead of inflating and parsing the input again. Entries are keyed
+// by the path, size and mtime of the input.
+class DecodeCache {
+
+public:
+    // Returns the path of the entry for <fpath>, or an empty string if the
+    // cache is disabled.
+    static std::string Locate(const char* fpath) {
+        const char* dir = getenv(UTIL_VECS_CACHE_ENV);
+        struct stat st;
+        char* real_fpath;
+        if (!dir || !*dir || stat(fpath, &st) != 0 ||
+                !(real_fpath = realpath(fpath, nullptr))) {
+            return std::string();
+        }
+        std::string source(real_fpath);
+        free(real_fpath);
+        char name[64];
+        sprintf(name, "/%016lx-%016lx.bin", Hash(source),
+                Hash(std::to_string(st.st_size).append(":")
+                .append(std::to_string(st.st_mtim.tv_sec)).append(".")
+                .append(std::to_string(st.st_mtim.tv_nsec))));
+        return std::string(dir).append(name);
+    }
+
+    // Copies the vecs stream of <file> into <fpath> through a BinFile, and
+    // drops the stale entries of the same input. Returns false, leaving no
+    // entry behind, if the vectors don't share one dimension.
+    static bool Fill(File* file, size_t elem_size, const std::string& fpath) {
+        std::string tmp_fpath(fpath);
+        tmp_fpath.append(".").append(std::to_string(getpid()));
+        BinFile writer(new PlainFile, elem_size);
+        try {
+            writer.open(tmp_fpath.c_str(), false);
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        bool ok = true;
+        try {
+            std::vector<char> chunk(UTIL_VECS_CHUNK);
+            while (true) {
+                ssize_t n = file->read(chunk.data(), chunk.size());
+                if (n <= 0) {
+                    break;
+                }
+                if (writer.write(chunk.data(), n) != n) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        catch (const std::exception&) {
+            ok = false;
+        }
+        try {
+            writer.close();
+        }
+        catch (const std::exception&) {
+            ok = false;
+        }
+        if (!ok || rename(tmp_fpath.c_str(), fpath.c_str()) != 0) {
+            unlink(tmp_fpath.c_str());
+            return false;
+        }
+        Prune(fpath);
+        return true;
+    }
+
+private:
+    static uint64_t Hash(const std::string& str) {
+        uint64_t hash = 14695981039346656037UL;
+        for (size_t i = 0; i < str.length(); i++) {
+            hash = (hash ^ (unsigned char)str[i]) * 1099511628211UL;
+        }
+        return hash;
+    }
+
+    static void Prune(const std::string& fpath) {
+        size_t slash = fpath.rfind('/');
+        std::string dir = fpath.substr(0, slash);
+        std::string name = fpath.substr(slash + 1);
+        std::string prefix = name.substr(0, name.find('-') + 1);
+        DIR* dirp = opendir(dir.c_str());
+        if (!dirp) {
+            return;
+        }
+        while (struct dirent* entry = readdir(dirp)) {
+            std::string entry_name(entry->d_name);
+            if (entry_name != name &&
+                    entry_name.compare(0, prefix.length(), prefix) == 0) {
+                unlink(std::string(dir).append("/").append(entry_name)
+                        .c_str());
+            }
+        }
+        closedir(dirp);
+    }
+
+};
+
+class Catalog {
+
+private:
+    struct Header {
+        uint64_t count;
+        uint64_t dim;
+        uint64_t record_size;
+    };
+
+    size_t count;
+    size_t dim;
+    size_t record_size;
+    std::vector<uint64_t> offsets;
+
+public:
+    Catalog() : count(0), dim(0), record_size(0), offsets(1, 0) {}
+
+    size_t size() const {
+        return count;
+    }
+
+    // 0 if the vectors don't share the same dimension.
+    size_t getDim() const {
+        return dim;
+    }
+
+    // For files whose vectors are known to share <dim>, like BinFile.
+    void assign(size_t count, size_t dim, size_t elem_size) {
+        this->count = count;
+        this->dim = dim;
+        record_size = sizeof(uint32_t) + elem_size * dim;
+        offsets.assign(1, 0);
+    }
+
+    size_t offset(size_t index) const {
+        assert(index <= count);
+        return record_size ? index * record_size : offsets[index];
+    }
+
+    void scan(File* file, size_t elem_size) {
+        count = 0;
+        dim = 0;
+        record_size = 0;
+        offsets.assign(1, 0);
+        uint64_t position = 0;
+        while (true) {
+            uint32_t d;
+            ssize_t ret = file->read(&d, sizeof(d));
+            if (ret == 0) {
+                assert(file->eof());
+                break;
+            }
+            if (ret != sizeof(d)) {
+                throw std::runtime_error("broken file!");
+            }
+            if (file->seek(elem_size * d, SEEK_CUR) < 0) {
+                throw std::runtime_error("broken file!");
+            }
+            size_t size = sizeof(d) + elem_size * d;
+            if (count == 0) {
+                dim = d;
+                record_size = size;
+            }
+            else if (record_size && size != record_size) {
+                for (size_t i = 1; i <= count; i++) {
+                    offsets.push_back(i * record_size);
+                }
+                dim = 0;
+                record_size = 0;
+            }
+            position += size;
+            count++;
+            if (!record_size) {
+                offsets.push_back(position);
+            }
+        }
+    }
+
+    bool load(const char* fpath, const struct stat& source) {
+        Sidecar sidecar;
+        Header header;
+        if (!sidecar.open(fpath, UTIL_VECS_CATALOG_MAGIC, source, true) ||
+                !sidecar.read(&header, sizeof(header))) {
+            return false;
+        }
+        count = header.count;
+        dim = header.dim;
+        record_size = header.record_size;
+        offsets.assign(1, 0);
+        if (!record_size) {
+            offsets.resize(count + 1);
+            return sidecar.read(offsets.data(),
+                    sizeof(uint64_t) * (count + 1));
+        }
+        return true;
+    }
+
+    // Best effort: a catalog that can't be saved is simply rebuilt next time.
+    void save(const char* fpath, const struct stat& source) const {
+        Sidecar sidecar;
+        Header header;
+        header.count = count;
+        header.dim = dim;
+        header.record_size = record_size;
+        if (!sidecar.open(fpath, UTIL_VECS_CATALOG_MAGIC, source, false) ||
+                !sidecar.write(&header, sizeof(header))) {
+            return;
+        }
+        if (!record_size && !sidecar.write(offsets.data(),
+                sizeof(uint64_t) * (count + 1))) {
+            return;
+        }
+        sidecar.commit();
+    }
+
+};
+
+template <typename T>
+class Formater {
+
+private:
+    File* file;
+    const Catalog* catalog;
+    std::vector<T> buffer;
+
+public:
+    Formater(File* _file, const Catalog* _catalog = nullptr) :
+            file(_file), catalog(_catalog) {}
+
+    std::vector<T> read() {
+        size_t dim;
+        std::vector<T> vector;
+        if (!readDim(dim)) {
+            return vector;
+        }
+        vector.resize(dim);
+        readData(vector.data(), dim);
+        return vector;
+    }
+
+    // Like read(), but returns a pointer that stays valid until the next
+    // call, pointing into the file itself whenever it supports map().
+    // Returns nullptr at the end of file.
+    const T* view(size_t& dim) {
+        if (!readDim(dim)) {
+            dim = 0;
+            return nullptr;
+        }
+        const T* data = (const T*)file->map(sizeof(T) * dim);
+        if (data) {
+            return data;
+        }
+        buffer.resize(dim);
+        readData(buffer.data(), dim);
+        return buffer.data();
+    }
+
+    // Reads up to <n> vectors of <dim> dimensions into the row-major matrix
+    // <dst>. Returns the number of vectors read, less than <n> only at the
+    // end of file.
+    size_t readBatch(size_t n, size_t dim, T* dst) {
+        const T* rows = (const T*)file->mapRows(n, sizeof(T) * dim);
+        if (rows) {
+            memcpy(dst, rows, sizeof(T) * dim * n);
+            return n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t vector_dim;
+            if (!readDim(vector_dim)) {
+                return i;
+            }
+            checkDim(dim, vector_dim);
+            readData(dst + dim * i, dim);
+        }
+        return n;
+    }
+
+    // Like readBatch(), but <n> is updated to the number of vectors read,
+    // and the matrix points into the file itself whenever it supports
+    // mapRows(), or into <buffer> otherwise.
+    const T* viewBatch(size_t& n, size_t dim, std::vector<T>& buffer) {
+        const T* rows = (const T*)file->mapRows(n, sizeof(T) * dim);
+        if (rows) {
+            return rows;
+        }
+        buffer.resize(n * dim);
+        n = readBatch(n, dim, buffer.data());
+        return buffer.data();
+    }
+
+    template <typename TDst>
+    size_t readBatchConverted(size_t n, size_t dim, TDst* dst) {
+        util::vector::Converter<T, TDst> converter;
+        const T* rows = (const T*)file->mapRows(n, sizeof(T) * dim);
+        if (rows) {
+            converter(dst, rows, n * dim);
+            return n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t vector_dim;
+            const T* vector = view(vector_dim);
+            if (!vector) {
+                return i;
+            }
+            checkDim(dim, vector_dim);
+            converter(dst + dim * i, vector, dim);
+        }
+        return n;
+    }
+
+    bool skip() {
+        size_t dim;
+        if (!readDim(dim)) {
+            return false;
+        }
+        if (file->seek(sizeof(T) * dim, SEEK_CUR) < 0) {
+            throw std::runtime_error("broken file!");
+        }
+        return true;
+    }
+
+    void reset() {
+        file->seek(0, SEEK_SET);
+    }
+
+    // Without a catalog, this counts by skipping through the whole file and
+    // leaves it rewound.
+    size_t count() {
+        if (catalog) {
+            return catalog->size();
+        }
+        reset();
+        size_t n = 0;
+        while (skip()) {
+            n++;
+        }
+        reset();
+        return n;
+    }
+
+    // Moves to the <index>-th vector, in O(1) with a catalog.
+    void seek(size_t index) {
+        if (catalog) {
+            if (index > catalog->size()) {
+                throw std::runtime_error("index out of range!");
+            }
+            if (file->seek(catalog->offset(index), SEEK_SET) < 0) {
+                throw std::runtime_error("broken file!");
+            }
+            return;
+        }
+        reset();
+        for (size_t i = 0; i < index; i++) {
+            if (!skip()) {
+                throw std::runtime_error("index out of range!");
+            }
+        }
+    }
+
+    void write(const std::vector<T>& vector) {
+        write(vector.data(), vector.size());
+    }
+
+    void write(const T* data, size_t dim) {
+        uint32_t d = dim;
+        ssize_t ret = file->write(&d, sizeof(d));
+        if (ret != sizeof(d)) {
+            throw std::runtime_error("Output error!");
+        }
+        ret = file->write(data, sizeof(T) * dim);
+        if (ret != (ssize_t)(sizeof(T) * dim)) {
+            throw std::runtime_error("Output error!");
+        }
+    }
+
+private:
+    bool readDim(size_t& dim) {
+        uint32_t d;
+        ssize_t ret = file->read(&d, sizeof(d));
+        if (ret == 0) {
+            assert(file->eof());
+            return false;
+        }
+        if (ret != sizeof(d)) {
+            throw std::runtime_error("broken file!");
+        }
+        dim = d;
+        return true;
+    }
+
+    void readData(T* data, size_t dim) {
+        ssize_t ret = file->read(data, sizeof(T) * dim);
+        if (ret != (ssize_t)(sizeof(T) * dim)) {
+            throw std::runtime_error("broken file!");
+        }
+    }
+
+    static void checkDim(size_t expected, size_t dim) {
+        if (dim != expected) {
+            char buf[256];
+            sprintf(buf, "expect %luD vectors, but this vector is %luD!",
+                    expected, dim);
+            throw std::runtime_error(buf);
+        }
+    }
+
+};
+
+// Fills batches on a background thread, up to <depth> of them ahead of the
+// consumer, so that reading and decoding the input overlaps with whatever
+// the consumer does with the previous batches. The consumer may hold on to
+// the last <held> batches it got.
+template <typename TBatch>
+class ReadAhead {
+
+public:
+    // Fills the batch it is given (which may hold an old batch), and returns
+    // false instead at the end of input.
+    typedef std::function<bool(TBatch&)> Producer;
+
+private:
+    Producer producer;
+    size_t held;
+    std::vector<TBatch> batches;
+    size_t produced;
+    size_t consumed;
+    bool finished;
+    bool stopping;
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+
+public:
+    ReadAhead(const Producer& _producer,
+            size_t depth = UTIL_VECS_READAHEAD_DEPTH, size_t _held = 1) :
+            producer(_producer), held(std::max<size_t>(1, _held)),
+            batches(depth + held), produced(0),
+            consumed(0), finished(false), stopping(false) {
+        thread = std::thread([this] {
+            work();
+        });
+    }
+
+    ~ReadAhead() {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        changed.notify_all();
+        lock.unlock();
+        thread.join();
+    }
+
+    // Returns the next batch, valid until <held> more calls, or nullptr at
+    // the end of input. Errors of the producer are thrown here, in order.
+    TBatch* next() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] {
+            return produced > consumed || finished;
+        });
+        if (produced == consumed) {
+            if (!error.empty()) {
+                throw std::runtime_error(error);
+            }
+            return nullptr;
+        }
+        TBatch* batch = &batches[consumed++ % batches.size()];
+        changed.notify_all();
+        return batch;
+    }
+
+private:
+    // The consumer still holds the last <held> batches it got, hence the
+    // <held> slots more than <depth>.
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] {
+                return stopping || produced - consumed + held < batches.size();
+            });
+            if (stopping) {
+                return;
+            }
+            TBatch& batch = batches[produced % batches.size()];
+            lock.unlock();
+            bool more = false;
+            std::string batch_error;
+            try {
+                more = producer(batch);
+            }
+            catch (const std::exception& e) {
+                batch_error = e.what();
+            }
+            lock.lock();
+            if (!more) {
+                error = batch_error;
+                finished = true;
+                changed.notify_all();
+                return;
+            }
+            produced++;
+            changed.notify_all();
+        }
+    }
+
+};
+
+class SuffixWrapper {
+private:
+    File* file;
+    BinFile* bin;
+    char type;
+    std::string path;
+    bool rw;
+    bool cataloged;
+    Catalog catalog;
+
+public:
+    SuffixWrapper(const char* fpath, bool _rw) :
+            bin(nullptr), path(fpath), rw(_rw), cataloged(false) {
+        std::string suffix(fpath);
+        std::string compression;
+        const char* compressions[] = {".gz", ".zst", ".lz4"};
+        for (const char* extension : compressions) {
+            if (EndsWith(suffix, extension)) {
+                compression = extension;
+                suffix.resize(suffix.length() - compression.length());
+                break;
+            }
+        }
+        bool is_bin = true;
+        if (EndsWith(suffix, ".u8bin")) {
+            type = 'b';
+        }
+        else if (EndsWith(suffix, ".i8bin")) {
+            type = 'c';
+        }
+        else if (EndsWith(suffix, ".ibin")) {
+            type = 'i';
+        }
+        else if (EndsWith(suffix, ".fbin")) {
+            type = 'f';
+        }
+        else {
+            is_bin = false;
+        }
+        if (is_bin) {
+            if (!rw && !compression.empty()) {
+                throw std::runtime_error(std::string("cannot write "
+                        "compressed file '").append(fpath).append("'!"));
+            }
+        }
+        else if (EndsWith(suffix, ".bvecs")) {
+            type = 'b';
+        }
+        else if (EndsWith(suffix, ".ivecs")) {
+            type = 'i';
+        }
+        else if (EndsWith(suffix, ".fvecs")) {
+            type = 'f';
+        }
+        else {
+            throw std::runtime_error(std::string("unsupported format '")
+                    .append(fpath).append("'!"));
+        }
+        file = NewFile(compression, rw);
+        if (is_bin) {
+            bin = new BinFile(file, ElemSize(type));
+            file = bin;
+        }
+        std::unique_ptr<File> file_deleter(file);
+        file->open(fpath, rw);
+        file_deleter.release();
+        if (rw && (!is_bin || !compression.empty())) {
+            openCached(fpath);
+        }
+    }
+
+    ~SuffixWrapper() {
+        file->close();
+        delete file;
+    }
+
+    File* getFile() const {
+        return file;
+    }
+
+    // 'b' for uint8, 'c' for int8, 'i' for int32 and 'f' for float.
+    char getDataType() const {
+        return type;
+    }
+
+    // Loads the catalog from the "<fpath>.idx" sidecar, or builds and caches
+    // it with one pass over the file. Call it before reading, since building
+    // rewinds the file.
+    const Catalog& getCatalog() {
+        if (cataloged) {
+            return catalog;
+        }
+        if (!rw) {
+            throw std::runtime_error("cannot catalog a file for writing!");
+        }
+        if (bin) {
+            catalog.assign(bin->getCount(), bin->getDim(), ElemSize(type));
+            cataloged = true;
+            return catalog;
+        }
+        std::string idx_fpath(path);
+        idx_fpath.append(UTIL_VECS_CATALOG_SUFFIX);
+        struct stat st;
+        bool has_stat = stat(path.c_str(), &st) == 0;
+        if (!has_stat || !catalog.load(idx_fpath.c_str(), st)) {
+            catalog.scan(file, ElemSize(type));
+            file->seek(0, SEEK_SET);
+            if (has_stat) {
+                catalog.save(idx_fpath.c_str(), st);
+            }
+        }
+        cataloged = true;
+        return catalog;
+    }
+
+private:
+    // Switches to the DecodeCache entry of <fpath>, filling it first if
+    // needed. The input stays open if it can't be cached.
+    void openCached(const char* fpath) {
+        std::string cache_fpath = DecodeCache::Locate(fpath);
+        if (cache_fpath.empty()) {
+            return;
+        }
+        if (access(cache_fpath.c_str(), R_OK) != 0 &&
+                !DecodeCache::Fill(file, ElemSize(type), cache_fpath)) {
+            file->seek(0, SEEK_SET);
+            return;
+        }
+        BinFile* cached = new BinFile(new MappedFile, ElemSize(type));
+        std::unique_ptr<File> cached_deleter(cached);
+        try {
+            cached->open(cache_fpath.c_str(), true);
+        }
+        catch (const std::exception&) {
+            file->seek(0, SEEK_SET);
+            return;
+        }
+        file->close();
+        delete file;
+        file = cached_deleter.release();
+        bin = cached;
+    }
+
+    static File* NewFile(const std::string& compression, bool rw) {
+        if (compression == ".gz") {
+            return rw ? (File*)new GzFile : (File*)new BlockGzFile;
+        }
+        if (compression == ".zst") {
+#ifndef DISABLE_ZSTD
+            return rw ? (File*)new ZstdFile : (File*)new BlockZstdFile;
+#else
+            throw std::runtime_error("built without zstd support!");
+#endif
+        }
+        if (compression == ".lz4") {
+#ifndef DISABLE_LZ4
+            return rw ? (File*)new Lz4File : (File*)new BlockLz4File;
+#else
+            throw std::runtime_error("built without lz4 support!");
+#endif
+        }
+        return rw ? (File*)new MappedFile : (File*)new PlainFile;
+    }
+
+    static size_t ElemSize(char type) {
+        return type == 'b' || type == 'c' ? 1 : 4;
+    }
+
     static bool EndsWith(const std::string& str, const std::string& suffix) {
         size_t str_len = str.length();
         size_t suffix_len = suffix.length();
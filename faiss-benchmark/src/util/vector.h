@@ -3,11 +3,19 @@
 
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <sys/mman.h>
+
+#include "simd.h"
+
+#define UTIL_VECTOR_HUGE_PAGE   (2UL << 20)
+
 namespace util {
 
 namespace vector {
@@ -16,20 +24,26 @@ template <typename TSrc, typename TDst>
 struct Converter {
 
     std::vector<TDst> operator ()(const std::vector<TSrc>& src) {
-        size_t count = src.size();
         std::vector<TDst> dst;
-        dst.resize(count);
-        for (size_t i = 0; i < count; i++) {
-            dst[i] = static_cast<TDst>(src[i]);
-        }
+        dst.resize(src.size());
+        (*this)(dst.data(), src.data(), src.size());
         return dst;
     }
 
     void operator ()(TDst* dst, const std::vector<TSrc>& src) {
-        size_t count = src.size();
-        for (size_t i = 0; i < count; i++) {
-            dst[i] = static_cast<TDst>(src[i]);
-        }
+        (*this)(dst, src.data(), src.size());
+    }
+
+    // Vectorized for the common pairs, see util::simd::Convert().
+    void operator ()(TDst* dst, const TSrc* src, size_t count) {
+        util::simd::Convert(dst, src, count);
+    }
+
+    const TDst* operator ()(const TSrc* src, size_t count,
+            std::vector<TDst>& buffer) {
+        buffer.resize(count);
+        (*this)(buffer.data(), src, count);
+        return buffer.data();
     }
 
 };
@@ -46,7 +60,15 @@ struct Converter<T, T> {
     }
 
     void operator ()(T* dst, const std::vector<T>& src) {
-        memcpy(dst, src.data(), src.size() * sizeof(T));
+        (*this)(dst, src.data(), src.size());
+    }
+
+    void operator ()(T* dst, const T* src, size_t count) {
+        memcpy(dst, src, count * sizeof(T));
+    }
+
+    const T* operator ()(const T* src, size_t count, std::vector<T>& buffer) {
+        return src;
     }
 
 };
@@ -55,19 +77,22 @@ template <typename TV1, typename TV2, typename TResult>
 class DistanceAlgo {
 
 public:
-    virtual ~DistanceAlgo() {}
+    typedef TResult (*kernel_t)(const TV1*, const TV2*, size_t, TResult);
 
-    virtual TResult operator ()(const std::vector<TV1>& v1,
-            const std::vector<TV2>& v2) = 0;
+protected:
+    kernel_t kernel;
+    kernel_t bounded;
 
-};
-
-template <typename TV1, typename TV2, typename TResult>
-class DistanceL1 : public DistanceAlgo<TV1, TV2, TResult> {
+    // <_bounded> may give up once the distance exceeds the bound, see
+    // util::simd::Distance(). Without it, bounds are ignored.
+    DistanceAlgo(kernel_t _kernel, kernel_t _bounded = nullptr)
+            : kernel(_kernel), bounded(_bounded ? _bounded : _kernel) {}
 
 public:
+    virtual ~DistanceAlgo() {}
+
     TResult operator ()(const std::vector<TV1>& v1,
-            const std::vector<TV2>& v2) override {
+            const std::vector<TV2>& v2) {
         size_t dim = v1.size();
         if (v2.size() != dim) {
             char buf[256];
@@ -75,37 +100,195 @@ public:
                     "while <v2> has %lu dimensions!", dim, v2.size());
             throw std::runtime_error(buf);
         }
-        TResult sum = 0;
-        for (size_t i = 0; i < dim; i++) {
-            TResult delta = static_cast<TResult>(v1[i]) - 
-                    static_cast<TResult>(v2[i]);
-            sum += std::abs(delta);
-        }
-        return sum;
+        return kernel(v1.data(), v2.data(), dim, 0);
+    }
+
+    // Unchecked, for hot loops.
+    TResult operator ()(const TV1* v1, const TV2* v2, size_t dim) {
+        return kernel(v1, v2, dim, 0);
     }
 
+    // The distance when it is at most <bound>, otherwise anything above
+    // <bound>.
+    TResult operator ()(const TV1* v1, const TV2* v2, size_t dim,
+            TResult bound) {
+        return bounded(v1, v2, dim, bound);
+    }
+
+    kernel_t getKernel() const {
+        return kernel;
+    }
+
+};
+
+// All of them use the SIMD kernels of util::simd::DistanceKernel.
+template <typename TV1, typename TV2, typename TResult>
+class DistanceL1 : public DistanceAlgo<TV1, TV2, TResult> {
+
+public:
+    DistanceL1() : DistanceAlgo<TV1, TV2, TResult>(util::simd::DistanceKernel
+            <util::simd::L1, TV1, TV2, TResult>::get(), util::simd::
+            DistanceKernel<util::simd::L1, TV1, TV2, TResult>::getBounded()) {}
+
 };
 
 template <typename TV1, typename TV2, typename TResult>
 class DistanceL2Sqr : public DistanceAlgo<TV1, TV2, TResult> {
 
 public:
-    TResult operator ()(const std::vector<TV1>& v1,
-            const std::vector<TV2>& v2) override {
-        size_t dim = v1.size();
-        if (v2.size() != dim) {
-            char buf[256];
-            sprintf(buf, "argument <v1> has %lu dimensions, "
-                    "while <v2> has %lu dimensions!", dim, v2.size());
-            throw std::runtime_error(buf);
+    DistanceL2Sqr() : DistanceAlgo<TV1, TV2, TResult>(util::simd::
+            DistanceKernel<util::simd::L2, TV1, TV2, TResult>::get(),
+            util::simd::DistanceKernel<util::simd::L2, TV1, TV2, TResult>::
+            getBounded()) {}
+
+};
+
+// The negative inner product, so that the nearer is the smaller.
+template <typename TV1, typename TV2, typename TResult>
+class DistanceIP : public DistanceAlgo<TV1, TV2, TResult> {
+
+public:
+    DistanceIP() : DistanceAlgo<TV1, TV2, TResult>(util::simd::
+            DistanceKernel<util::simd::IP, TV1, TV2, TResult>::get()) {}
+
+};
+
+// 1 - cos(v1, v2). Scans that compare many pairs can compute the inverse
+// norms once per vector with InverseNorm(), and get the very same distances
+// from Product() and Combine().
+template <typename TV1, typename TV2>
+class DistanceCosine : public DistanceAlgo<TV1, TV2, float> {
+
+public:
+    DistanceCosine() : DistanceAlgo<TV1, TV2, float>(Kernel) {}
+
+    // The negative inner product.
+    static float Product(const TV1* v1, const TV2* v2, size_t dim) {
+        static auto kernel = util::simd::DistanceKernel<util::simd::IP,
+                TV1, TV2, float>::get();
+        return kernel(v1, v2, dim, 0);
+    }
+
+    // 0 for a zero vector, which is then at distance 1 from everything.
+    template <typename T>
+    static float InverseNorm(const T* v, size_t dim) {
+        static auto kernel = util::simd::DistanceKernel<util::simd::IP,
+                T, T, float>::get();
+        float square = -kernel(v, v, dim, 0);
+        return square > 0 ? 1 / std::sqrt(square) : 0;
+    }
+
+    static float Combine(float product, float inverse_norm1,
+            float inverse_norm2) {
+        return 1 + product * inverse_norm1 * inverse_norm2;
+    }
+
+private:
+    static float Kernel(const TV1* v1, const TV2* v2, size_t dim, float) {
+        return Combine(Product(v1, v2, dim), InverseNorm(v1, dim),
+                InverseNorm(v2, dim));
+    }
+
+};
+
+// A row-major matrix in one 64-byte aligned block. Blocks of at least
+// UTIL_VECTOR_HUGE_PAGE bytes are mapped separately and backed by
+// transparent huge pages where available, to save TLB misses on scans.
+template <typename T>
+class Matrix {
+
+private:
+    T* elements;
+    size_t rows;
+    size_t dim;
+    size_t capacity;
+    size_t mapped;
+
+public:
+    Matrix() : elements(nullptr), rows(0), dim(0), capacity(0), mapped(0) {}
+
+    Matrix(size_t rows, size_t dim) : Matrix() {
+        resize(rows, dim);
+    }
+
+    Matrix(const Matrix&) = delete;
+
+    Matrix& operator =(const Matrix&) = delete;
+
+    ~Matrix() {
+        release();
+    }
+
+    // Keeps the block whenever it is large enough, so the content survives
+    // only when <dim> doesn't change and the matrix doesn't grow.
+    void resize(size_t rows, size_t dim) {
+        size_t count = rows * dim;
+        if (count > capacity) {
+            release();
+            allocate(count);
+        }
+        this->rows = rows;
+        this->dim = dim;
+    }
+
+    size_t size() const {
+        return rows;
+    }
+
+    size_t getDim() const {
+        return dim;
+    }
+
+    T* data() {
+        return elements;
+    }
+
+    const T* data() const {
+        return elements;
+    }
+
+    T* operator [](size_t row) {
+        return elements + dim * row;
+    }
+
+    const T* operator [](size_t row) const {
+        return elements + dim * row;
+    }
+
+private:
+    void allocate(size_t count) {
+        size_t len = sizeof(T) * count;
+        void* addr = nullptr;
+        if (len >= UTIL_VECTOR_HUGE_PAGE) {
+            len = (len + UTIL_VECTOR_HUGE_PAGE - 1) /
+                    UTIL_VECTOR_HUGE_PAGE * UTIL_VECTOR_HUGE_PAGE;
+            addr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr == MAP_FAILED) {
+                throw std::runtime_error("out of memory!");
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(addr, len, MADV_HUGEPAGE);
+#endif
+            mapped = len;
+        }
+        else if (posix_memalign(&addr, 64, std::max<size_t>(len, 1)) != 0) {
+            throw std::runtime_error("out of memory!");
+        }
+        elements = (T*)addr;
+        capacity = count;
+    }
+
+    void release() {
+        if (mapped) {
+            munmap(elements, mapped);
         }
-        TResult sum = 0;
-        for (size_t i = 0; i < dim; i++) {
-            TResult delta = static_cast<TResult>(v1[i]) - 
-                    static_cast<TResult>(v2[i]);
-            sum += delta * delta;
+        else {
+            free(elements);
         }
-        return sum;
+        elements = nullptr;
+        capacity = 0;
+        mapped = 0;
     }
 
 };